@@ -57,7 +57,7 @@ extern void vAssertCalled( uint32_t line, char* filename );
 #define configCPU_CLOCK_HZ        ( ( unsigned long ) 96000000 )
 #define configTICK_RATE_HZ        ( ( TickType_t ) 1000 )
 #define configMINIMAL_STACK_SIZE  ( ( unsigned short ) 256 )
-#define configTOTAL_HEAP_SIZE     ( ( size_t ) ( 10240 ) )
+#define configTOTAL_HEAP_SIZE     ( ( size_t ) ( 8704 ) ) // About 7.1kB used by the tasks and queues, see the usb "mem" command
 #define configMAX_TASK_NAME_LEN   ( 10 )
 #define configUSE_TRACE_FACILITY    0
 #define configUSE_16_BIT_TICKS      0
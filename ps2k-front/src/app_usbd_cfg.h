@@ -67,7 +67,7 @@ extern "C"
 /* The following manifest constants are used to define this memory area to be used
    by USBD_LIB stack.
  */
-#define USB_STACK_MEM_BASE      0x10003000
+#define USB_STACK_MEM_BASE      0x10003800 // Top 2kB of the 16kB SRAM, RamLoc16 ends here
 #define USB_STACK_MEM_SIZE      0x0800
 
 /* USB descriptor arrays defined *_desc.c file */
@@ -0,0 +1,49 @@
+/*
+ * boottime.c - Boot phase timestamps, from main() to the first readback on the display
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpiomap.h"
+#include "boottime.h"
+#include "stopwatch.h"
+
+// StopWatch is started first thing in main() and runs from 0, so its ticks are the time
+// since boot. It runs at 3MHz (96MHz CCLK, PCLK CCLK/4, prescaler 8) and wraps after
+// about 23.8 minutes, far beyond any boot.
+static uint32_t s_ticks[BOOT_NUM_PHASES];
+static volatile bool s_reached[BOOT_NUM_PHASES];
+
+static const char* const s_phase_names[BOOT_NUM_PHASES] = {
+	"main", "tasks", "probed", "risers up", "init done", "first readback", "splash done", "first display"
+};
+
+// Cheap enough to be called every time something happens, only the first call counts.
+// Also called from main() before the scheduler runs, so no critical section here: each
+// phase is marked from a single task and the time is stored before the flag is set.
+void boot_mark(boot_phase_t phase) {
+	if (phase >= BOOT_NUM_PHASES || s_reached[phase]) return;
+	s_ticks[phase] = StopWatch_Start();
+	__DMB();
+	s_reached[phase] = true;
+}
+
+uint32_t boot_get_us(boot_phase_t phase) {
+	if (phase >= BOOT_NUM_PHASES || !s_reached[phase]) return BOOT_NOT_REACHED;
+	return StopWatch_TicksToUs(s_ticks[phase]);
+}
+
+const char* boot_phase_name(boot_phase_t phase) {
+	return phase < BOOT_NUM_PHASES ? s_phase_names[phase] : "?";
+}
@@ -0,0 +1,25 @@
+#ifndef BOOTTIME_H_
+#define BOOTTIME_H_
+
+#include "chip.h"
+
+// Boot phases in the order they normally happen, only the first occurrence is recorded
+typedef enum {
+	BOOT_MAIN = 0, // main() entered, StopWatch started
+	BOOT_TASKS, // Scheduler running
+	BOOT_PROBED, // Risers asked for their image id (warm start check)
+	BOOT_RISERS_UP, // All risers running (loaded or already running), link up
+	BOOT_INIT_DONE, // Setpoints fetched from all live risers
+	BOOT_FIRST_READBACK, // First readback frame received
+	BOOT_SPLASH_DONE, // Splash screen removed
+	BOOT_FIRST_DISPLAY, // First readback shown
+	BOOT_NUM_PHASES
+} boot_phase_t;
+
+#define BOOT_NOT_REACHED (0xffffffff)
+
+void boot_mark(boot_phase_t phase);
+uint32_t boot_get_us(boot_phase_t phase);
+const char* boot_phase_name(boot_phase_t phase);
+
+#endif /* BOOTTIME_H_ */
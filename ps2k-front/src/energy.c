@@ -0,0 +1,139 @@
+/*
+ * energy.c - Per-channel charge (Ah) and energy (Wh) accumulation from readback
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpiomap.h"
+#include "energy.h"
+#include "powersupply.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "stopwatch.h"
+#include <string.h>
+
+// Readback further apart than this (link lost, riser restarted) is not integrated
+#define MAX_GAP_MS (500)
+
+// Accumulators use the trapezoidal rule with the measured time between readbacks, so
+// jitter in frame spacing doesn't matter. Units are riser percent (1/256%) times
+// microseconds, doubled as the halving of the trapezoid is postponed until read out.
+// Power is V% * I% rounded to 1/256, nominal V * nominal I is 25600^2 / 256. That keeps
+// a 4V 20mA load on an 84V 5A unit within 0.1% of the true power instead of truncating
+// it to 1/10000 of nominal, and still lasts for over a month at full scale.
+#define POWER_SHIFT (8)
+
+typedef struct {
+	uint64_t charge;
+	uint64_t energy;
+	uint64_t us;
+	uint32_t last_time; // StopWatch ticks
+	uint16_t last_curr;
+	uint32_t last_power;
+	bool have_last;
+	bool running;
+} energy_acc_t;
+
+static energy_acc_t s_energy[NUM_CHANNELS];
+
+void energy_init(void) {
+	memset(s_energy, 0, sizeof(s_energy));
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		s_energy[chnum].running = true;
+	}
+}
+
+// Called from ps_task for every readback received
+void energy_add(uint32_t chnum, uint16_t volt, uint16_t curr) {
+	if (chnum >= NUM_CHANNELS) return;
+	energy_acc_t* e = &s_energy[chnum];
+	uint32_t now = StopWatch_Start();
+	uint32_t power = ((uint32_t)volt * curr + (1 << (POWER_SHIFT - 1))) >> POWER_SHIFT;
+
+	taskENTER_CRITICAL();
+	uint32_t dt = now - e->last_time;
+	if (e->running && e->have_last && dt < StopWatch_MsToTicks(MAX_GAP_MS)) {
+		uint32_t dt_us = StopWatch_TicksToUs(dt);
+		e->charge += (uint64_t)(e->last_curr + curr) * dt_us;
+		e->energy += ((uint64_t)e->last_power + power) * dt_us;
+		e->us += dt_us;
+		// Sub-microsecond remainder is carried over to the next interval
+		e->last_time += StopWatch_UsToTicks(dt_us);
+	} else {
+		e->last_time = now;
+	}
+	e->last_curr = curr;
+	e->last_power = power;
+	e->have_last = e->running;
+	taskEXIT_CRITICAL();
+}
+
+void energy_start(uint32_t chnum) {
+	if (chnum >= NUM_CHANNELS) return;
+	s_energy[chnum].running = true;
+}
+
+// Stopping also forgets the last readback so the stopped interval is never integrated
+void energy_stop(uint32_t chnum) {
+	if (chnum >= NUM_CHANNELS) return;
+	taskENTER_CRITICAL();
+	s_energy[chnum].running = false;
+	s_energy[chnum].have_last = false;
+	taskEXIT_CRITICAL();
+}
+
+void energy_reset(uint32_t chnum) {
+	if (chnum >= NUM_CHANNELS) return;
+	taskENTER_CRITICAL();
+	s_energy[chnum].charge = 0;
+	s_energy[chnum].energy = 0;
+	s_energy[chnum].us = 0;
+	taskEXIT_CRITICAL();
+}
+
+static uint32_t dec_scale(uint32_t exp) {
+	uint32_t result = 1;
+	while (exp--) result *= 10;
+	return result;
+}
+
+void energy_get(uint32_t chnum, energy_info_t* info) {
+	memset(info, 0, sizeof(*info));
+	if (chnum >= NUM_CHANNELS) return;
+	energy_acc_t* e = &s_energy[chnum];
+
+	taskENTER_CRITICAL();
+	uint64_t charge = e->charge;
+	uint64_t energy = e->energy;
+	uint64_t us = e->us;
+	info->running = e->running;
+	taskEXIT_CRITICAL();
+
+	// Down to percent seconds and power in 1/10000 of nominal (25600^2 / 65536) first to
+	// keep the scaling below within 64 bits
+	charge /= 2000000;
+	energy /= 2000000ull << (16 - POWER_SHIFT);
+
+	const conversion_info_t* conv = ps_get_conv_info_ptr();
+	uint64_t volt_nom = conv[CONVERSION_VOLTAGE].max_setpoint;
+	uint64_t curr_nom = conv[CONVERSION_CURRENT].max_setpoint;
+	uint64_t curr_scale = dec_scale(conv[CONVERSION_CURRENT].num_decimals);
+	uint64_t power_scale = dec_scale(conv[CONVERSION_VOLTAGE].num_decimals + conv[CONVERSION_CURRENT].num_decimals);
+
+	// mAh = I%s * nominal I * 1000 / (25600 * 3600)
+	info->charge_mah = (charge * curr_nom * 1000) / (PS_FULL_SCALE * 3600ull * curr_scale);
+	// mWh = P * nominal V * nominal I * 1000 / (10000 * 3600)
+	info->energy_mwh = (energy * volt_nom * curr_nom) / (36000ull * power_scale);
+	info->seconds = us / 1000000;
+}
@@ -0,0 +1,20 @@
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include "chip.h"
+
+typedef struct {
+	uint32_t charge_mah;
+	uint32_t energy_mwh;
+	uint32_t seconds; // Time integrated
+	bool running;
+} energy_info_t;
+
+void energy_init(void);
+void energy_add(uint32_t chnum, uint16_t volt, uint16_t curr);
+void energy_start(uint32_t chnum);
+void energy_stop(uint32_t chnum);
+void energy_reset(uint32_t chnum);
+void energy_get(uint32_t chnum, energy_info_t* info);
+
+#endif /* ENERGY_H_ */
@@ -153,6 +153,7 @@ uart1 connects to ch2 @500kbps
 
 #define PORT4_DIR (_BV(CH2_RESET_BIT) | _BV(CH2_ISP_BIT))
 
+// Riser slots on the front panel board, the ones actually fitted are found at boot
 #define NUM_CHANNELS (2)
 
 // Ch0 or 1 for simplicity during indexing
@@ -0,0 +1,168 @@
+/*
+ * history.c - Per-channel readback history with 1s, 10s and 1min min/avg/max tiers
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpiomap.h"
+#include "history.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include <string.h>
+
+// Running min/sum/max for the entry currently being built in a tier
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+} hist_acc_t;
+
+typedef struct {
+	hist_acc_t volt;
+	hist_acc_t curr;
+	uint32_t count;
+} tier_acc_t;
+
+typedef struct {
+	hist_entry_t* entries;
+	uint32_t size;
+	uint32_t head; // Next entry to write
+	uint32_t used;
+	tier_acc_t acc;
+} tier_t;
+
+typedef struct {
+	hist_raw_t raw[HIST_RAW_SIZE];
+	uint32_t raw_head;
+	uint32_t raw_used;
+	TickType_t second_start;
+	hist_entry_t e1s[HIST_1S_SIZE];
+	hist_entry_t e10s[HIST_10S_SIZE];
+	hist_entry_t e1min[HIST_1MIN_SIZE];
+	tier_t tiers[HIST_NUM_TIERS];
+} chhist_t;
+
+static chhist_t s_hist[NUM_CHANNELS];
+
+// Number of entries from the tier below making up one entry
+static const uint8_t s_tier_ratio[HIST_NUM_TIERS] = {0, 10, 6};
+
+static void acc_add(hist_acc_t* acc, const hist_minmax_t* val, bool first) {
+	if (first || val->min < acc->min) acc->min = val->min;
+	if (first || val->max > acc->max) acc->max = val->max;
+	acc->sum = first ? val->avg : acc->sum + val->avg;
+}
+
+static void tier_add(tier_t* t, const hist_entry_t* e) {
+	bool first = t->acc.count == 0;
+	acc_add(&t->acc.volt, &e->volt, first);
+	acc_add(&t->acc.curr, &e->curr, first);
+	t->acc.count++;
+}
+
+static void acc_result(const hist_acc_t* acc, uint32_t count, hist_minmax_t* out) {
+	out->min = acc->min;
+	out->max = acc->max;
+	out->avg = (acc->sum + count / 2) / count;
+}
+
+// Close the entry being built in tier and feed it to the next tier
+static void tier_close(chhist_t* h, hist_tier_t tier) {
+	tier_t* t = &h->tiers[tier];
+	if (!t->acc.count) return;
+
+	hist_entry_t e;
+	acc_result(&t->acc.volt, t->acc.count, &e.volt);
+	acc_result(&t->acc.curr, t->acc.count, &e.curr);
+	t->acc.count = 0;
+
+	taskENTER_CRITICAL();
+	t->entries[t->head] = e;
+	t->head = (t->head + 1) % t->size;
+	if (t->used < t->size) t->used++;
+	taskEXIT_CRITICAL();
+
+	if (tier + 1 < HIST_NUM_TIERS) {
+		tier_t* next = &h->tiers[tier + 1];
+		tier_add(next, &e);
+		if (next->acc.count >= s_tier_ratio[tier + 1]) tier_close(h, tier + 1);
+	}
+}
+
+void hist_init(void) {
+	memset(s_hist, 0, sizeof(s_hist));
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		chhist_t* h = &s_hist[chnum];
+		h->tiers[HIST_TIER_1S].entries = h->e1s;
+		h->tiers[HIST_TIER_1S].size = HIST_1S_SIZE;
+		h->tiers[HIST_TIER_10S].entries = h->e10s;
+		h->tiers[HIST_TIER_10S].size = HIST_10S_SIZE;
+		h->tiers[HIST_TIER_1MIN].entries = h->e1min;
+		h->tiers[HIST_TIER_1MIN].size = HIST_1MIN_SIZE;
+	}
+}
+
+// Called from ps_task for every readback received
+void hist_add(uint32_t chnum, uint16_t volt, uint16_t curr) {
+	if (chnum >= NUM_CHANNELS) return;
+	chhist_t* h = &s_hist[chnum];
+	TickType_t now = xTaskGetTickCount();
+
+	taskENTER_CRITICAL();
+	h->raw[h->raw_head].volt = volt;
+	h->raw[h->raw_head].curr = curr;
+	h->raw_head = (h->raw_head + 1) % HIST_RAW_SIZE;
+	if (h->raw_used < HIST_RAW_SIZE) h->raw_used++;
+	taskEXIT_CRITICAL();
+
+	if ((now - h->second_start) >= configTICK_RATE_HZ) {
+		tier_close(h, HIST_TIER_1S);
+		// Stay aligned to whole seconds unless readback has been missing for a while
+		if ((now - h->second_start) < (2 * configTICK_RATE_HZ)) {
+			h->second_start += configTICK_RATE_HZ;
+		} else {
+			h->second_start = now;
+		}
+	}
+	hist_entry_t e = {{volt, volt, volt}, {curr, curr, curr}};
+	tier_add(&h->tiers[HIST_TIER_1S], &e);
+}
+
+bool hist_get_raw(uint32_t chnum, uint32_t idx, hist_raw_t* out) {
+	if (chnum >= NUM_CHANNELS) return false;
+	chhist_t* h = &s_hist[chnum];
+	bool ok = false;
+
+	taskENTER_CRITICAL();
+	if (idx < h->raw_used) {
+		*out = h->raw[(h->raw_head + HIST_RAW_SIZE - 1 - idx) % HIST_RAW_SIZE];
+		ok = true;
+	}
+	taskEXIT_CRITICAL();
+	return ok;
+}
+
+bool hist_get(uint32_t chnum, hist_tier_t tier, uint32_t idx, hist_entry_t* out) {
+	if (chnum >= NUM_CHANNELS || tier >= HIST_NUM_TIERS) return false;
+	tier_t* t = &s_hist[chnum].tiers[tier];
+	bool ok = false;
+
+	taskENTER_CRITICAL();
+	if (idx < t->used) {
+		*out = t->entries[(t->head + t->size - 1 - idx) % t->size];
+		ok = true;
+	}
+	taskEXIT_CRITICAL();
+	return ok;
+}
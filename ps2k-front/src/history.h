@@ -0,0 +1,53 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include "chip.h"
+
+// Entries per channel for each tier, override to trade history length for RAM.
+// Raw samples use 4 bytes each, tier entries 12 bytes each. The defaults (about 980 bytes
+// per channel) cover 2s of raw readback at the default poll interval, 20s, 3min and 20min.
+// The usb "mem" command shows what is left for the main stack when making them bigger.
+#ifndef HIST_RAW_SIZE
+#define HIST_RAW_SIZE (40)
+#endif
+#ifndef HIST_1S_SIZE
+#define HIST_1S_SIZE (20)
+#endif
+#ifndef HIST_10S_SIZE
+#define HIST_10S_SIZE (18)
+#endif
+#ifndef HIST_1MIN_SIZE
+#define HIST_1MIN_SIZE (20)
+#endif
+
+typedef enum {
+	HIST_TIER_1S = 0,
+	HIST_TIER_10S,
+	HIST_TIER_1MIN,
+	HIST_NUM_TIERS
+} hist_tier_t;
+
+// Readback in riser percent units
+typedef struct {
+	uint16_t volt;
+	uint16_t curr;
+} hist_raw_t;
+
+typedef struct {
+	uint16_t min;
+	uint16_t avg;
+	uint16_t max;
+} hist_minmax_t;
+
+typedef struct {
+	hist_minmax_t volt;
+	hist_minmax_t curr;
+} hist_entry_t;
+
+void hist_init(void);
+void hist_add(uint32_t chnum, uint16_t volt, uint16_t curr);
+// Index 0 is the newest entry, false is returned if the entry doesn't exist (yet)
+bool hist_get_raw(uint32_t chnum, uint32_t idx, hist_raw_t* out);
+bool hist_get(uint32_t chnum, hist_tier_t tier, uint32_t idx, hist_entry_t* out);
+
+#endif /* HISTORY_H_ */
@@ -19,34 +19,7 @@
 #include "gpiomap.h"
 #include "FreeRTOS.h"
 #include "task.h"
-
-static uint32_t uuencode(char* dst, uint8_t* src, uint32_t srclen) {
-	if (srclen > 45) return 0;
-
-	uint32_t len = 0;
-	dst[len++] = 0x20 + srclen;
-
-	for (uint32_t i = 0; i < srclen ; i += 3) {
-		uint32_t uugroup = src[i] << 16 |
-				((i < (srclen-1)) ? src[i + 1] << 8 : 0) |
-				((i < (srclen-2)) ? src[i + 2] : 0);
-		for (uint32_t j = 0; j < 4; j++) {
-			if (uugroup & (0b111111 << 18)) { // non-zero 6-bit char
-				uugroup += (0x20 << 18); // only add 0x20 to the 6-bit char
-			} else {
-				uugroup += (0x60 << 18); // add 0x60
-			}
-			dst[len++] = (uint8_t)(uugroup >> 18);
-			// Make sure we don't have any left-overs from last byte
-			uugroup &= (1 << 18) - 1;
-			uugroup <<= 6; // next 6-bit chunk
-
-		}
-	}
-	dst[len++] = '\r';
-	dst[len++] = '\n';
-	return len;
-}
+#include <string.h>
 
 static uint32_t num2ascii(char* outbuf, uint32_t num) {
 	// Returns number of characters which will be used even if outbuf is NULL
@@ -74,168 +47,422 @@ static uint32_t num2ascii(char* outbuf, uint32_t num) {
 	return digits;
 }
 
-extern uint8_t modulefw[];
-extern uint32_t modulefwsize;
+// Compressed riser image with decompressor stub, uuencoded with checksums at build time
+// by tools/lzpack.py (see modulefw.s)
+typedef struct {
+	uint32_t load; // Riser RAM address to write the blob to
+	uint32_t exec; // Decompressor stub entry, thumb code
+	uint32_t size; // Blob size for W
+	uint32_t image_id;
+	uint32_t num_blocks;
+	uint32_t block_end[]; // Text offset where each block ends, followed by the text
+} isp_stream_t;
 
-// Major hack at the moment, needs cleanup
-void isp_mode(void) {
-	uint8_t* xferstart = modulefw;
-	uint32_t xferlen = modulefwsize;
-	uint32_t exec = *(uint32_t*)(&modulefw[4]) & ~1; // Remove thumb bit
-	uint32_t dest = exec & ~0xff; // hack using reset vector of the image (assuming resetisr is located less than 0xff bytes from the start)
+extern const isp_stream_t modulefw;
+#define ISP_TEXT ((const char*)&modulefw.block_end[modulefw.num_blocks])
 
-	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+// ISP runs concurrently on all channels, every channel has its own state machine which
+// is polled once per tick. Commands are fed to the UART FIFOs without blocking and
+// every step has a timeout and a number of attempts.
+typedef struct {
+	const char* cmd; // NULL if built at run time
+	const char* expect; // Response is complete when received data ends with this
+	uint16_t timeout_ms; // Counted from when the command has been sent
+	uint8_t attempts;
+	bool long_response; // More than the 16 byte rx FIFO can arrive within a tick
+} isp_step_t;
+
+// Received data is matched with a newline prepended so that "\n0\r\n" only matches a
+// stand-alone return code and not the echo of a command ending in " 0\r\n"
+static const isp_step_t s_steps[ISP_DONE] = {
+	[ISP_RESET] = {NULL, NULL, ISP_RESET_DELAY_MS, 1}, // Handled separately
+	[ISP_SYNC] = {"?", "Synchronized\r\n", ISP_SYNC_TIMEOUT_MS, ISP_SYNC_RETRIES},
+	[ISP_SYNC_ACK] = {"Synchronized\r\n", "OK\r\n", ISP_CMD_TIMEOUT_MS, 1, true}, // Echo is still on
+	[ISP_CLOCK] = {"12000\r\n", "OK\r\n", ISP_CMD_TIMEOUT_MS, 1},
+	[ISP_ECHO_OFF] = {"A 0\r\n", "\n0\r\n", ISP_CMD_TIMEOUT_MS, 1},
+	[ISP_UNLOCK] = {"U 23130\r\n", "\n0\r\n", ISP_CMD_TIMEOUT_MS, 2},
+	[ISP_WRITE] = {NULL, "\n0\r\n", ISP_CMD_TIMEOUT_MS, 2},
+	[ISP_DATA] = {NULL, "OK\r\n", ISP_CMD_TIMEOUT_MS, 3}, // Attempts per checksum block
+	[ISP_VERIFY] = {NULL, "\n0\r\n", ISP_CMD_TIMEOUT_MS, 1, true}, // Timeout restarts on every byte
+	[ISP_GO] = {NULL, "\n0\r\n", ISP_CMD_TIMEOUT_MS, 1},
+};
+
+static const char* const s_state_names[ISP_NUM_STATES] = {
+	"reset", "sync", "sync ack", "clock", "echo off", "unlock", "write", "data", "verify", "go", "done", "failed", "idle", "running"
+};
+
+static const uint32_t s_baud_rates[] = ISP_BAUD_RATES;
+#define ISP_NUM_BAUD_RATES (sizeof(s_baud_rates) / sizeof(s_baud_rates[0]))
+
+typedef struct {
+	isp_status_t status;
+	uint32_t attempt;
+	TickType_t start; // When the command was completely sent
+	char tx[24]; // Commands, image data is sent straight from flash
+	const char* txdata;
+	uint32_t txlen;
+	uint32_t txpos;
+	char rx[24];
+	uint32_t rxlen;
+	uint32_t block; // Current checksum block
+	bool verifying; // Readback data is being received
+	uint32_t verify_pos; // Next text position to compare with
+	TickType_t verify_start;
+	uint32_t baud_idx;
+	uint32_t rate_attempt; // Loads at this rate that failed after syncing
+	bool released; // Reset released in ISP_RESET
+	TickType_t released_at;
+} isp_ch_t;
+
+static isp_ch_t s_isp[NUM_CHANNELS];
+
+static uint32_t isp_build_cmd(char* buf, char cmd, uint32_t arg1, uint32_t arg2, bool thumb) {
+	uint32_t num = 0;
+	buf[num++] = cmd;
+	buf[num++] = ' ';
+	num += num2ascii(&buf[num], arg1);
+	buf[num++] = ' ';
+	if (thumb) {
+		buf[num++] = 'T';
+	} else {
+		num += num2ascii(&buf[num], arg2);
+	}
+	buf[num++] = '\r';
+	buf[num++] = '\n';
+	return num;
+}
+
+// Send the command for the current state (again)
+static void isp_begin_step(uint32_t chnum) {
+	isp_ch_t* isp = &s_isp[chnum];
+	// Make sure no garbage (like echoes) is left in the UART rx FIFO
+	Chip_UART_SetupFIFOS(CHx_UART(chnum), (UART_FCR_FIFO_EN | UART_FCR_RX_RS));
+	isp->rx[0] = '\n';
+	isp->rxlen = 1;
+	isp->verifying = false;
+	isp->txdata = isp->tx;
+	isp->txpos = 0;
+	isp->start = xTaskGetTickCount();
+
+	const isp_step_t* step = &s_steps[isp->status.state];
+	switch (isp->status.state) {
+	case ISP_RESET:
 		CHx_RESET(chnum, 0);
 		// Set ISP pin low (request ISP mode)
 		CHx_ISP(chnum, 0);
-		vTaskDelay(1);
-		// Set reset pin high to bring module out of reset
-		CHx_RESET(chnum, 1);
+		isp->released = false;
+		isp->txlen = 0;
+		break;
+	case ISP_WRITE:
+		// Blob goes to the top of RAM, the stub unpacks the image below it
+		isp->txlen = isp_build_cmd(isp->tx, 'W', modulefw.load, modulefw.size, false);
+		break;
+	case ISP_DATA: {
+		// Whole block including the checksum line, again from the start on retries
+		uint32_t start = isp->block ? modulefw.block_end[isp->block - 1] : 0;
+		isp->txdata = &ISP_TEXT[start];
+		isp->txlen = modulefw.block_end[isp->block] - start;
+		break;
+	}
+	case ISP_VERIFY:
+		isp->txlen = isp_build_cmd(isp->tx, 'R', modulefw.load, modulefw.size, false);
+		isp->block = 0;
+		isp->verify_pos = 0;
+		isp->verify_start = isp->start;
+		break;
+	case ISP_GO:
+		// Run the decompressor, thumb mode, it starts the image when done
+		isp->txlen = isp_build_cmd(isp->tx, 'G', modulefw.exec, 0, true);
+		break;
+	default:
+		isp->txlen = strlen(step->cmd);
+		memcpy(isp->tx, step->cmd, isp->txlen);
+	}
+}
+
+static void isp_next_state(uint32_t chnum, isp_state_t state) {
+	isp_ch_t* isp = &s_isp[chnum];
+	isp->status.state = state;
+	isp->attempt = 0;
+	if (state < ISP_DONE) isp_begin_step(chnum);
+}
 
-		Chip_UART_SetBaud(CHx_UART(chnum), 115200);
+static void isp_fail(uint32_t chnum) {
+	isp_ch_t* isp = &s_isp[chnum];
+	isp->status.failed_step = isp->status.state;
+	if (isp->status.state > ISP_SYNC && ++isp->rate_attempt < ISP_ATTEMPTS_PER_RATE) {
+		// The bootloader answered at this rate, start over at the same rate. Not when sync
+		// failed, that has had its retries and a missing riser shouldn't hold up the boot.
+		isp->status.restarts++;
+	} else if (isp->baud_idx + 1 < ISP_NUM_BAUD_RATES) {
+		// Start over at a lower rate
+		isp->baud_idx++;
+		isp->rate_attempt = 0;
+		isp->status.fallbacks++;
+	} else {
+		isp->status.state = ISP_FAILED;
+		// Keep the riser in reset
+		CHx_RESET(chnum, 0);
+		CHx_ISP(chnum, 1);
+		return;
 	}
+	isp->block = 0;
+	isp_next_state(chnum, ISP_RESET);
+}
 
-	vTaskDelay(310); // Reset supervisor requires this HUMONGOUS delay
+// The bootloader answers R with the same uuencoded rows and checksum lines as sent for W,
+// so the readback is compared with the stored text directly. Zero 6-bit groups may be
+// encoded as either ' ' or '`'. Returns false if the state has changed.
+static bool isp_verify_byte(uint32_t chnum, char c, TickType_t now) {
+	isp_ch_t* isp = &s_isp[chnum];
+	if (isp->block == modulefw.num_blocks) return true; // All compared, ignore anything trailing
 
-	char isptmp[72];
+	char expect = ISP_TEXT[isp->verify_pos];
+	if (c == '`') c = ' ';
+	if (expect == '`') expect = ' ';
+	if (c != expect) {
+		// What's in riser RAM isn't the image, try again from the start
+		isp_fail(chnum);
+		return false;
+	}
+	isp->start = now; // Not a fresh tick count, start must never be ahead of the poll's now
 
-	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
-		// Make sure no garbage is in the UART FIFO
-		Chip_UART_SetupFIFOS(CHx_UART(chnum), (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS));
-
-		Chip_UART_SendBlocking(CHx_UART(chnum), "?", 1);
-		// Wait for "Synchronized\r\n" (14 bytes)
-		uint32_t num = 0;
-		while (num < 14) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
-		}
+	if (++isp->verify_pos == modulefw.block_end[isp->block]) {
+		// Block and its checksum line matched, acknowledge to get the next one
+		isp->block++;
+		memcpy(isp->tx, "OK\r\n", 4);
+		isp->txdata = isp->tx;
+		isp->txlen = 4;
+		isp->txpos = 0;
+	}
+	return true;
+}
 
-		// RIGHT BACK AT YA! (note that this gets echoed back and this echo should be discarded)
-		Chip_UART_SendBlocking(CHx_UART(chnum), isptmp, 14);
-		// Wait for "OK\r\n" (4 bytes)
-		num = 0;
-		while (num < 4) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
-		}
+static bool isp_rx_endswith(const isp_ch_t* isp, const char* str) {
+	uint32_t len = strlen(str);
+	return isp->rxlen >= len && !memcmp(&isp->rx[isp->rxlen - len], str, len);
+}
 
-		// Send crystal frequency in khz (unused for this part, this cmd is also echoed)
-		Chip_UART_SendBlocking(CHx_UART(chnum), "12000\r\n", 7);
-		// Wait for "OK\r\n" (4 bytes)
-		num = 0;
-		while (num < 4) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
+// Returns true while the channel has data waiting to be sent
+static bool isp_poll(uint32_t chnum) {
+	isp_ch_t* isp = &s_isp[chnum];
+	LPC_USART_T* pUART = CHx_UART(chnum);
+	const isp_step_t* step = &s_steps[isp->status.state];
+	TickType_t now = xTaskGetTickCount();
+
+	if (isp->status.state == ISP_RESET) {
+		if (!isp->released) {
+			if (now != isp->start) {
+				// Set reset pin high to bring module out of reset
+				CHx_RESET(chnum, 1);
+				isp->released = true;
+				isp->start = now;
+				// Load time includes fallbacks and restarts
+				if (!isp->status.fallbacks && !isp->status.restarts) isp->released_at = now;
+			}
+		} else if ((now - isp->start) >= step->timeout_ms) {
+			// What actually ends up on the wire, 230769 for 230400
+			isp->status.baud = Chip_UART_SetBaudFDR(pUART, s_baud_rates[isp->baud_idx]);
+			Chip_UART_SetupFIFOS(pUART, (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS));
+			isp_next_state(chnum, ISP_SYNC);
 		}
+		return false;
+	}
 
-		// Send echo off cmd (this is echoed)
-		Chip_UART_SendBlocking(CHx_UART(chnum), "A 0\r\n", 5);
-		// Wait for "0\r\n" (3 bytes)
-		num = 0;
-		while (num < 3) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
+	// Keep the tx FIFO fed, it holds 16 bytes when empty
+	if (isp->txpos < isp->txlen) {
+		if (Chip_UART_ReadLineStatus(pUART) & UART_LSR_THRE) {
+			for (uint32_t i = 0; i < 16 && isp->txpos < isp->txlen; i++) {
+				Chip_UART_SendByte(pUART, isp->txdata[isp->txpos++]);
+			}
 		}
+		isp->start = now;
+		if (isp->txpos < isp->txlen) return true;
 	}
 
-	vTaskDelay(1);
+	if (isp->status.state == ISP_VERIFY && isp->block == modulefw.num_blocks) {
+		// Last block acknowledged, the image is good
+		isp->status.verify_ms = now - isp->verify_start;
+		isp_next_state(chnum, ISP_GO);
+		return true;
+	}
 
-	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
-		// Make sure no garbage is in the UART FIFO
-		Chip_UART_SetupFIFOS(CHx_UART(chnum), (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS));
-
-		// Send unlock cmd (finally no echo!)
-		Chip_UART_SendBlocking(CHx_UART(chnum), "U 23130\r\n", 9);
-		// Wait for "0\r\n" (3 bytes)
-		uint32_t num = 0;
-		while (num < 3) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
+	// Collect the response, only the end of it is of interest
+	uint8_t tmp;
+	while (Chip_UART_Read(pUART, &tmp, 1)) {
+		if (isp->verifying) {
+			if (!isp_verify_byte(chnum, tmp, now)) return false;
+			continue;
+		}
+		if (isp->rxlen == sizeof(isp->rx)) {
+			memmove(isp->rx, &isp->rx[1], sizeof(isp->rx) - 1);
+			isp->rxlen--;
+		}
+		isp->rx[isp->rxlen++] = tmp;
+		// Readback data follows the return code of R right away
+		if (isp->status.state == ISP_VERIFY && isp_rx_endswith(isp, step->expect)) {
+			isp->verifying = true;
 		}
+	}
 
-		// Send write RAM cmd (destination and length derived from reset vector in module blob)
-		num = 0;
-		isptmp[num++] = 'W';
-		isptmp[num++] = ' ';
-		num += num2ascii(&isptmp[num], dest);
-		isptmp[num++] = ' ';
-		num += num2ascii(&isptmp[num], xferlen);
-		isptmp[num++] = '\r';
-		isptmp[num++] = '\n';
-		Chip_UART_SendBlocking(CHx_UART(chnum), isptmp, num);
-		// Wait for "0\r\n" (3 bytes)
-		num = 0;
-		while (num < 3) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
+	if (isp->status.state != ISP_VERIFY && isp_rx_endswith(isp, step->expect)) {
+		switch (isp->status.state) {
+		case ISP_DATA:
+			isp->status.blocks++;
+			if (++isp->block < modulefw.num_blocks) {
+				// Next block
+				isp->attempt = 0;
+				isp_begin_step(chnum);
+			} else {
+				isp_next_state(chnum, ISP_VERIFY_READBACK ? ISP_VERIFY : ISP_GO);
+			}
+			break;
+		case ISP_GO:
+			isp->status.load_ms = now - isp->released_at;
+			isp_next_state(chnum, ISP_DONE);
+			// Back to the 500kbps for regular operation, this also resets the fractional
+			// divider (plain Chip_UART_SetBaud leaves it alone)
+			Chip_UART_SetBaudFDR(pUART, 500000);
+			// Make sure no garbage is in the UART FIFO
+			Chip_UART_SetupFIFOS(pUART, (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS));
+			break;
+		default:
+			isp_next_state(chnum, isp->status.state + 1);
 		}
+		return isp->status.state < ISP_DONE; // Next command to send
 	}
 
-	// Send uuencoded data here, checksum after every 20 rows, and at the end
-	uint32_t rowcount = 0;
-	uint32_t cksumoffset = 0;
-	for (uint32_t i = 0; i < xferlen; i += 45) {
-		uint32_t len = xferlen - i;
-		if (len > 45) {
-			len = 45;
-			rowcount++;
+	bool resend = isp->status.state == ISP_DATA && isp_rx_endswith(isp, "RESEND\r\n");
+	if (resend || (now - isp->start) >= step->timeout_ms) {
+		isp->status.retries++;
+		if (++isp->attempt < step->attempts) {
+			isp_begin_step(chnum);
 		} else {
-			// Last line (which may or may not be the full 45 encoded bytes long)
-			// Force checksum
-			rowcount = 20;
-		}
-		uint32_t uulen = uuencode(isptmp, &xferstart[i], len);
-		if (rowcount == 20) {
-			// Append checksum to data
-			uint32_t cksum = calc_checksum(&xferstart[cksumoffset], len + i - cksumoffset);
-			uulen += num2ascii(&isptmp[uulen], cksum);
-			isptmp[uulen++] = '\r';
-			isptmp[uulen++] = '\n';
-			cksumoffset = i + len;
+			isp_fail(chnum);
 		}
+	}
+	return false;
+}
+
+uint32_t isp_image_id(void) {
+	return modulefw.image_id;
+}
+
+// Risers keep running when only the front panel restarts (watchdog, or a firmware update
+// without power cycling). Ask for the image id over the regular 500kbps link, a riser
+// already running this image doesn't need the reset and reload.
+#define PROBE_TIMEOUT_MS (3)
+#define PROBE_ATTEMPTS (2) // Second try in case the riser had a partial frame buffered
+
+// Returns the mask of channels in chmask running the current image, the UARTs have to be
+// set up for 500kbps without interrupts. Status of all channels is reset to idle/running.
+uint32_t isp_probe_running(uint32_t chmask) {
+	uint8_t req[] = {0x82, OBJ_IMAGE_ID, 0x00};
+	req[2] = (uint8_t)calc_checksum(req, 2);
+	uint32_t id = isp_image_id();
+	uint8_t expect[] = {0x86, OBJ_IMAGE_ID, id >> 24, (id >> 16) & 0xff, (id >> 8) & 0xff, id & 0xff, 0x00};
+	expect[6] = (uint8_t)calc_checksum(expect, 6);
+
+	uint32_t running = 0;
+	for (uint32_t attempt = 0; attempt < PROBE_ATTEMPTS && running != chmask; attempt++) {
+		uint32_t matched[NUM_CHANNELS] = {0};
+		uint32_t pending = chmask & ~running;
 		for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
-			Chip_UART_SendBlocking(CHx_UART(chnum), isptmp, uulen);
+			if (!(pending & _BV(chnum))) continue;
+			LPC_USART_T* pUART = CHx_UART(chnum);
+			Chip_UART_SetupFIFOS(pUART, (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS));
+			Chip_UART_SendBlocking(pUART, req, sizeof(req));
 		}
-		if (rowcount == 20) {
+
+		TickType_t start = xTaskGetTickCount();
+		while (pending && (xTaskGetTickCount() - start) <= PROBE_TIMEOUT_MS) {
+			vTaskDelay(1);
 			for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
-				// Wait for "OK\r\n" (4 bytes)
-				uint32_t num = 0;
-				while (num < 4) {
-					num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-					vTaskDelay(1);
+				LPC_USART_T* pUART = CHx_UART(chnum);
+				while ((pending & _BV(chnum)) && (Chip_UART_ReadLineStatus(pUART) & UART_LSR_RDR)) {
+					// Anything but the exact response (wrong image, or an unpatched one reporting
+					// id 0 which never matches) means the riser gets loaded
+					if (Chip_UART_ReadByte(pUART) != expect[matched[chnum]]) {
+						pending &= ~_BV(chnum);
+					} else if (++matched[chnum] == sizeof(expect)) {
+						running |= _BV(chnum);
+						pending &= ~_BV(chnum);
+					}
 				}
 			}
-			rowcount = 0;
 		}
 	}
 
 	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
-		// Send go cmd (jump to the reset vector, thumb mode)
-		uint32_t num = 0;
-		isptmp[num++] = 'G';
-		isptmp[num++] = ' ';
-		num += num2ascii(&isptmp[num], exec);
-		isptmp[num++] = ' ';
-		isptmp[num++] = 'T';
-		isptmp[num++] = '\r';
-		isptmp[num++] = '\n';
-		Chip_UART_SendBlocking(CHx_UART(chnum), isptmp, num);
-		// Wait for "0\r\n" (3 bytes)
-		num = 0;
-		while (num < 3) {
-			num += Chip_UART_Read(CHx_UART(chnum), &isptmp[num], sizeof(isptmp) - num);
-			vTaskDelay(1);
-		}
+		memset(&s_isp[chnum], 0, sizeof(s_isp[chnum]));
+		s_isp[chnum].status.state = (running & _BV(chnum)) ? ISP_RUNNING : ISP_IDLE;
+	}
+	return running;
+}
 
-		// ISP mode done, back to the 500kbps for regular operation
-		Chip_UART_SetBaud(CHx_UART(chnum), 500000);
+// Start RAM-loading the channels in chmask, the UART interrupts of these channels have to
+// be off. Other channels are left alone so a single riser can be reloaded while the rest
+// keep running.
+void isp_start(uint32_t chmask) {
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		if (!(chmask & _BV(chnum))) continue; // Status from isp_probe_running is kept
+		memset(&s_isp[chnum], 0, sizeof(s_isp[chnum]));
+		isp_next_state(chnum, ISP_RESET);
 	}
+}
+
+// Polls all channels being loaded, returns false when all of them are done or failed.
+// While sending, the FIFOs are refilled as soon as possible as a 1ms poll interval
+// would limit the throughput to 16 bytes/ms, less than what 230400 baud can do. The
+// same goes for receiving responses that would overrun the 16 byte rx FIFO in a tick,
+// the readback during verify (20 rows per block) and the echoed sync ack. In those
+// cases streaming is set and the caller must only yield until the next call.
+bool isp_service(bool* streaming) {
+	bool busy = false;
+	*streaming = false;
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		if (s_isp[chnum].status.state < ISP_DONE) {
+			*streaming |= isp_poll(chnum);
+		}
+		if (s_isp[chnum].status.state < ISP_DONE) {
+			*streaming |= s_steps[s_isp[chnum].status.state].long_response;
+			busy = true;
+		}
+	}
+	return busy;
+}
 
+// Channels in chmask that were loaded and started, ready for 500kbps operation
+uint32_t isp_done_mask(uint32_t chmask) {
+	uint32_t done = 0;
 	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
-		// Make sure no garbage is in the UART FIFO
-		Chip_UART_SetupFIFOS(CHx_UART(chnum), (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS));
+		if ((chmask & _BV(chnum)) && s_isp[chnum].status.state == ISP_DONE) done |= _BV(chnum);
 	}
+	return done;
+}
+
+// RAM-load and start the riser firmware on the channels in chmask, all channels in
+// parallel. Channels not answering (not fitted on single output models, or broken) fail
+// without holding up the others. Returns the mask of channels successfully started.
+uint32_t isp_mode(uint32_t chmask) {
+	isp_start(chmask);
+	bool streaming;
+	while (isp_service(&streaming)) {
+		if (streaming) {
+			taskYIELD();
+		} else {
+			vTaskDelay(1);
+		}
+	}
+	return isp_done_mask(chmask);
+}
+
+const isp_status_t* isp_get_status(uint32_t chnum) {
+	return &s_isp[chnum].status;
+}
+
+const char* isp_state_name(isp_state_t state) {
+	return state < ISP_NUM_STATES ? s_state_names[state] : "?";
 }
 
 uint32_t calc_checksum(uint8_t* buf, uint32_t size) {
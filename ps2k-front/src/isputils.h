@@ -3,7 +3,63 @@
 
 #include "chip.h"
 
-void isp_mode(void);
+// Bootloader baud rates to try, fastest first. The LPC13xx autobaud locks on to the
+// rate of the first "?" after reset, so falling back means resetting the riser again.
+// The UART PCLK is 24MHz, with an integer divider alone 230400 would end up as 250000,
+// so the rates are set using the fractional divider as well.
+#define ISP_BAUD_RATES {230400, 115200}
+#define ISP_RESET_DELAY_MS (310) // Reset supervisor requires this HUMONGOUS delay
+#define ISP_SYNC_TIMEOUT_MS (50)
+#define ISP_SYNC_RETRIES (3)
+#define ISP_CMD_TIMEOUT_MS (100)
+// A riser that synced at a rate but then failed (a block, or the readback) is loaded once
+// more at the same rate before falling back. A single transient error then neither costs
+// the rate nor, at the lowest rate, leaves the riser held in reset.
+#define ISP_ATTEMPTS_PER_RATE (2)
+// Read the loaded blob back and compare it with the image before starting it, the per-block
+// additive checksums alone can't be trusted with code driving the power stage
+#define ISP_VERIFY_READBACK (1)
+// Riser object holding the id of the running image, also checked while running
+#define OBJ_IMAGE_ID (0x4a)
+
+typedef enum {
+	ISP_RESET = 0,
+	ISP_SYNC,
+	ISP_SYNC_ACK,
+	ISP_CLOCK,
+	ISP_ECHO_OFF,
+	ISP_UNLOCK,
+	ISP_WRITE,
+	ISP_DATA,
+	ISP_VERIFY,
+	ISP_GO,
+	ISP_DONE,
+	ISP_FAILED,
+	ISP_IDLE, // Not loaded
+	ISP_RUNNING, // Already running this image, not loaded
+	ISP_NUM_STATES
+} isp_state_t;
+
+typedef struct {
+	isp_state_t state;
+	isp_state_t failed_step; // Valid if state is ISP_FAILED
+	uint32_t retries;
+	uint32_t blocks; // Data blocks acknowledged
+	uint32_t baud; // Rate used for the last (or current) attempt
+	uint32_t fallbacks; // Number of times the riser was reset to try a lower rate
+	uint32_t restarts; // Number of times the riser was reset to try again at the same rate
+	uint32_t load_ms; // Reset release to G acknowledged
+	uint32_t verify_ms; // Readback part of load_ms
+} isp_status_t;
+
+uint32_t isp_probe_running(uint32_t chmask);
+uint32_t isp_mode(uint32_t chmask);
+void isp_start(uint32_t chmask);
+bool isp_service(bool* streaming);
+uint32_t isp_done_mask(uint32_t chmask);
+uint32_t isp_image_id(void);
+const isp_status_t* isp_get_status(uint32_t chnum);
+const char* isp_state_name(isp_state_t state);
 uint32_t calc_checksum(uint8_t* buf, uint32_t size);
 
 #endif /* ISPUTILS_H_ */
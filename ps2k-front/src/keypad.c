@@ -17,6 +17,8 @@
 
 #include "gpiomap.h"
 #include "keypad.h"
+#include "ui.h"
+#include "stopwatch.h"
 #include "FreeRTOS.h"
 #include "task.h"
 #include <string.h>
@@ -38,15 +40,71 @@ static key_t s_keys_pressed = 0;
 // 0bxxxsssab
 // Number of quartersteps in bit 7-2 (signed, only -3 to 3 ever stored)
 // old pin state in bit 1-0
-int8_t encoderstate[4];
-int32_t encodercounter[4];
+int8_t encoderstate[ENC_NUM_ENCODERS];
+int32_t encodercounter[ENC_NUM_ENCODERS];
+
+// Acceleration, every full step counts as a multiple of the last digit depending on how
+// fast the knob turns. The multiples follow 1-2-5 so the speed ramps up smoothly and the
+// setpoint stays on round numbers (see get_encoder_delta). The speed is the average time
+// between steps, first entry slower than this gives the multiple.
+#define ACCEL_AVG_SHIFT (2) // Each new step interval weighs 1/4 in the average
+#define ACCEL_IDLE_US (200000) // Longer pauses (and reversing) start over at this speed
+typedef struct {
+	uint32_t max_interval_us;
+	uint32_t multiple;
+} accel_step_t;
+
+static const accel_step_t s_accel[] = {
+	{ 10000, 100 }, // Over 100 steps/s
+	{ 14000, 50 },
+	{ 20000, 20 },
+	{ 28000, 10 },
+	{ 40000, 5 },
+	{ 60000, 2 }, // Over ~17 steps/s
+};
+#define NUM_ACCEL_STEPS (sizeof(s_accel) / sizeof(s_accel[0]))
+
+typedef struct {
+	uint32_t last_step; // StopWatch ticks
+	uint32_t avg_interval_us;
+	int32_t dir;
+	uint32_t align; // Largest multiple used since get_encoder_delta
+} accel_t;
+
+static accel_t s_accel_state[ENC_NUM_ENCODERS];
+
+static uint32_t accel_step(encoder_t encodernum, int32_t dir) {
+	accel_t* acc = &s_accel_state[encodernum];
+	uint32_t now = StopWatch_Start();
+	uint32_t interval = StopWatch_TicksToUs(now - acc->last_step);
+	acc->last_step = now;
+
+	if (dir != acc->dir || interval >= ACCEL_IDLE_US) {
+		acc->dir = dir;
+		acc->avg_interval_us = ACCEL_IDLE_US;
+	} else {
+		acc->avg_interval_us += ((int32_t)interval - (int32_t)acc->avg_interval_us) >> ACCEL_AVG_SHIFT;
+	}
+
+	uint32_t multiple = 1;
+	for (uint32_t i = 0; i < NUM_ACCEL_STEPS; i++) {
+		if (acc->avg_interval_us < s_accel[i].max_interval_us) {
+			multiple = s_accel[i].multiple;
+			break;
+		}
+	}
+	if (multiple > acc->align) acc->align = multiple;
+	return multiple;
+}
 
-static void quadrature_decode(encoder_t encodernum, uint32_t newstate) {
+// Returns true when a full step has been taken
+static bool quadrature_decode(encoder_t encodernum, uint32_t newstate) {
 	int32_t oldstate = encoderstate[encodernum];
+	bool step = false;
 	newstate &= 0b11;
 	uint32_t tmp = (oldstate ^ newstate) & 0b111;
 	// Bail if no change or noise
-	if (tmp != 0b010 && tmp != 0b101 && tmp != 0b001 && tmp != 0b110) return;
+	if (tmp != 0b010 && tmp != 0b101 && tmp != 0b001 && tmp != 0b110) return false;
 
 	oldstate &= ~0b11;
 	oldstate |= newstate;
@@ -58,16 +116,23 @@ static void quadrature_decode(encoder_t encodernum, uint32_t newstate) {
 		oldstate -= (1 << 2); // Subtract one quarter step
 	}
 	if (oldstate < -12 || oldstate >= 16) { // Full step performed
-		encodercounter[encodernum] += (oldstate < 0) ? -1 : 1;
+		int32_t dir = (oldstate < 0) ? -1 : 1;
+		encodercounter[encodernum] += dir * (int32_t)accel_step(encodernum, dir);
 		oldstate = 0;
+		step = true;
 	}
 	encoderstate[encodernum] = (int8_t)oldstate;
+	return step;
 }
 
-int32_t get_encoder_delta(encoder_t encodernum) {
+// Accelerated steps since the last call. If align isn't NULL it gets the largest multiple
+// used, the caller should round the new setpoint to that.
+int32_t get_encoder_delta(encoder_t encodernum, uint32_t* align) {
 	taskENTER_CRITICAL();
 	int32_t delta = encodercounter[encodernum];
 	encodercounter[encodernum] = 0;
+	if (align) *align = s_accel_state[encodernum].align ? s_accel_state[encodernum].align : 1;
+	s_accel_state[encodernum].align = 0;
 	taskEXIT_CRITICAL();
 	return delta;
 }
@@ -89,6 +154,7 @@ void EINT3_IRQHandler(void) {
 	uint32_t gpio[3];
 	uint32_t tmp;
 	bool int_pend = true;
+	bool input = false;
 
 	while (int_pend) {
 		int_pend = false;
@@ -109,19 +175,19 @@ void EINT3_IRQHandler(void) {
 		uint32_t enc;
 		enc = ((!(gpio[ENC_B_CH1_VOLT_PORT] & _BV(ENC_B_CH1_VOLT_BIT))) |
 				((!(gpio[ENC_A_CH1_VOLT_PORT] & _BV(ENC_A_CH1_VOLT_BIT))) << 1));
-		quadrature_decode( ENC_CH1_VOLT, enc );
+		input |= quadrature_decode( ENC_CH1_VOLT, enc );
 
 		enc = ((!(gpio[ENC_B_CH1_CURR_PORT] & _BV(ENC_B_CH1_CURR_BIT))) |
 				((!(gpio[ENC_A_CH1_CURR_PORT] & _BV(ENC_A_CH1_CURR_BIT))) << 1));
-		quadrature_decode( ENC_CH1_CURR, enc );
+		input |= quadrature_decode( ENC_CH1_CURR, enc );
 
 		enc = ((!(gpio[ENC_B_CH2_VOLT_PORT] & _BV(ENC_B_CH2_VOLT_BIT))) |
 				((!(gpio[ENC_A_CH2_VOLT_PORT] & _BV(ENC_A_CH2_VOLT_BIT))) << 1));
-		quadrature_decode( ENC_CH2_VOLT, enc );
+		input |= quadrature_decode( ENC_CH2_VOLT, enc );
 
 		enc = ((!(gpio[ENC_B_CH2_CURR_PORT] & _BV(ENC_B_CH2_CURR_BIT))) |
 				((!(gpio[ENC_A_CH2_CURR_PORT] & _BV(ENC_A_CH2_CURR_BIT))) << 1));
-		quadrature_decode( ENC_CH2_CURR, enc );
+		input |= quadrature_decode( ENC_CH2_CURR, enc );
 	}
 
 // This will require some additional debounce for things to be 100%
@@ -130,8 +196,16 @@ void EINT3_IRQHandler(void) {
 		uint32_t tmp = s_gpio2key[i];
 		if (!(gpio[GET_PORT_NUM(tmp)] & GET_BIT_VAL(tmp))) newkeys |= 1 << i;
 	}
-	s_keys_pressed |= newkeys & (newkeys ^ s_keys_down);
+	key_t pressed = newkeys & (newkeys ^ s_keys_down);
+	s_keys_pressed |= pressed;
 	s_keys_down = newkeys;
+
+	// Wake the UI only for whole encoder steps and key presses, not every edge
+	if (input || pressed) {
+		BaseType_t woken = pdFALSE;
+		ui_post_event_from_isr(UI_EVT_INPUT, &woken);
+		portYIELD_FROM_ISR(woken);
+	}
 }
 
 void keypad_init(void) {
@@ -141,6 +215,7 @@ void keypad_init(void) {
 
 	for (int i = 0; i < sizeof(encoderstate); i++) {
 		encoderstate[i] = 0b00; // Detent at 0b00 after gpio invert
+		s_accel_state[i].avg_interval_us = ACCEL_IDLE_US;
 	}
 	int_en[BTN_TRACKING_PORT] |= _BV(BTN_TRACKING_BIT);
 	int_en[BTN_CH1_PRESET_PORT] |= _BV(BTN_CH1_PRESET_BIT);
@@ -22,7 +22,7 @@ typedef enum {
 } key_t;
 
 void keypad_init(void);
-int32_t get_encoder_delta(encoder_t encodernum);
+int32_t get_encoder_delta(encoder_t encodernum, uint32_t* align);
 key_t get_keys_pressed(void);
 key_t get_keys_down(void);
 
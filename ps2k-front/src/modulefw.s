@@ -10,11 +10,14 @@
 // The ps2k-front project will create the firmware.bin to be copied to the power supply
 // over USB after powering on with ch1 preset and on/off buttons pressed.
 
+// The riser image is compressed and encoded for ISP loading at build time by
+// tools/lzpack.py, see there for the format. The front panel copies it to the UARTs
+// as-is, the decompressor stub loaded with the image expands it on the riser. Less to send
+// over the UART means the risers are up sooner.
+
     .section ".text"
     .global modulefw
-    .global modulefwsize
     .type modulefw, "object"
+    .balign 4
 modulefw:
-    .incbin "../../ps2k-riser/Debug/ps2k-riser.bin"
-modulefwsize:
-    .word .-modulefw
+    .incbin "../../ps2k-riser/Debug/ps2k-riser.isp"
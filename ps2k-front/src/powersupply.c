@@ -19,138 +19,533 @@
 #include "powersupply.h"
 #include "FreeRTOS.h"
 #include "task.h"
+#include "event_groups.h"
 #include "isputils.h"
+#include "ring_buffer.h"
+#include "stopwatch.h"
+#include "history.h"
+#include "energy.h"
+#include "boottime.h"
+#include "ui.h"
+#include <string.h>
 
 static bool s_is_isp = false;
 static conversion_info_t s_psdata[CONVERSION_MAX_VAL];
 
 typedef struct {
-	uint32_t status;
-	uint32_t volt_readback_percent;
-	uint32_t curr_readback_percent;
 	uint32_t volt_setpoint;
 	uint32_t curr_setpoint;
+	uint32_t volt_setpoint_percent;
+	uint32_t curr_setpoint_percent;
+	bool onoff;
 	uint8_t rxbuf[16];
 	uint8_t numrx;
 } chinfo_rw_t;
 
 static chinfo_rw_t s_chinfo_rw[NUM_CHANNELS];
 
+// Readback published by ps_task. The snapshot being written is never the one indicated by
+// seq, so readers don't have to wait for (a possibly preempted) ps_task. A reader only
+// retries if seq changed while copying, meaning the buffer may have been reused.
+typedef struct {
+	ps_snapshot_t buf[2];
+	volatile uint32_t seq;
+} snapshot_pub_t;
+
+static snapshot_pub_t s_snapshot[NUM_CHANNELS];
+
+// New readback events, one bit per listener and channel so that every listener sees
+// every event no matter who else is waiting (listener * NUM_CHANNELS + channel). The bit
+// after those is set (and stays set) once the risers are up and their setpoints known.
+static EventGroupHandle_t s_readback_events = NULL;
+#define READY_BIT _BV(PS_NUM_LISTENERS * NUM_CHANNELS)
+
+// Received bytes are moved from the UART fifo to these rings in the UART interrupt
+#define RX_RING_SIZE (64)
+static RINGBUFF_T s_rxring[NUM_CHANNELS];
+static uint8_t s_rxring_buf[NUM_CHANNELS][RX_RING_SIZE];
+
+// Frames to send are queued here and fed to the UART from the THRE interrupt
+#define TX_RING_SIZE (64)
+#define UART_TX_FIFO_SIZE (16)
+#define UART_CHAR_US (20) // 10 bits at the 500kbps riser link
+static RINGBUFF_T s_txring[NUM_CHANNELS];
+static uint8_t s_txring_buf[NUM_CHANNELS][TX_RING_SIZE];
+static ps_tx_stats_t s_tx_stats[NUM_CHANNELS];
+
+static TaskHandle_t s_ps_task_handle = NULL;
+
+// Channels with a riser that answered at boot, only these are polled and shown
+#define ALL_CHANNELS_MASK (_BV(NUM_CHANNELS) - 1)
+static volatile uint32_t s_live_mask = 0;
+
 static void uart_setup(uint32_t chnum, uint32_t baudrate) {
 	LPC_USART_T* pUART = CHx_UART(chnum);
 	Chip_UART_Init(pUART);
 	Chip_UART_SetBaud(pUART, baudrate);
 	Chip_UART_TXEnable(pUART);
+	RingBuffer_Init(&s_rxring[chnum], s_rxring_buf[chnum], 1, RX_RING_SIZE);
+	RingBuffer_Init(&s_txring[chnum], s_txring_buf[chnum], 1, TX_RING_SIZE);
 
 	s_chinfo_rw[chnum].numrx = 0;
 }
 
-static uint32_t get_num_decimals( float nominal ) {
-	uint32_t num_decimals = 0; // No decimals, good for up to 9999V
-	if (nominal < 1000.0f) num_decimals++;
-	if (nominal < 100.0f) num_decimals++;
-	if (nominal < 10.0f) num_decimals++;
-	return num_decimals;
+// Only used once ISP is done, as ISP mode polls the UARTs directly
+static void uart_rx_int_enable(uint32_t chnum) {
+	LPC_USART_T* pUART = CHx_UART(chnum);
+	// Readback responses are 8 bytes and will trigger the interrupt right away,
+	// shorter responses are picked up by the character timeout interrupt
+	Chip_UART_SetupFIFOS(pUART, (UART_FCR_FIFO_EN | UART_FCR_RX_RS | UART_FCR_TX_RS | UART_FCR_TRG_LEV2));
+	RingBuffer_Flush(&s_rxring[chnum]);
+	RingBuffer_Flush(&s_txring[chnum]);
+	s_chinfo_rw[chnum].numrx = 0;
+	Chip_UART_IntEnable(pUART, UART_IER_RBRINT);
+	IRQn_Type irq = chnum ? UART1_IRQn : UART0_IRQn;
+	NVIC_SetPriority(irq, 2);
+	NVIC_EnableIRQ(irq);
 }
 
-static uint32_t num_dec_2_scale_factor(uint32_t num_decimals) {
-	uint32_t result = 1;
-	while (num_decimals > 0) {
-		result *= 10;
-		num_decimals--;
+static void uart_tx_fill(LPC_USART_T* pUART, RINGBUFF_T* pRB) {
+	// THRE is only set when the whole tx fifo is empty, so it can be filled up completely
+	if (Chip_UART_ReadLineStatus(pUART) & UART_LSR_THRE) {
+		uint8_t ch;
+		for (uint32_t i = 0; i < UART_TX_FIFO_SIZE && RingBuffer_Pop(pRB, &ch); i++) {
+			Chip_UART_SendByte(pUART, ch);
+		}
 	}
-	return result;
 }
 
-static uint32_t get_readback_multiplier( float nominal, uint32_t num_decimals) {
-	// To convert from 1/256% units to display value
-	// input * multiplier >> 16
-	// where multiplier is ((nominal * scale_factor) * 65536) / 25600
-	return (uint32_t)(((65536.0f * nominal * (float)num_dec_2_scale_factor(num_decimals)) / 25600.0f) + 0.5f);
+// Queue a complete frame for transmission, never blocks. Frames that don't fit are dropped
+// (the next setpoint update or request will be sent instead)
+static bool uart_send(uint32_t chnum, const uint8_t* buf, uint32_t len) {
+	LPC_USART_T* pUART = CHx_UART(chnum);
+	bool queued = false;
+
+	// Chip_UART_SendBlocking, used before the tx ring, waited for THRE before every byte
+	// but the first. Even with the line idle that kept the caller for this long.
+	uint32_t blocking_us = (len - 1) * UART_CHAR_US;
+	if (blocking_us > s_tx_stats[chnum].blocking_us) s_tx_stats[chnum].blocking_us = blocking_us;
+
+	uint32_t start = StopWatch_Start();
+	taskENTER_CRITICAL();
+	if (RingBuffer_GetFree(&s_txring[chnum]) >= len) {
+		RingBuffer_InsertMult(&s_txring[chnum], buf, len);
+		uart_tx_fill(pUART, &s_txring[chnum]);
+		Chip_UART_IntEnable(pUART, UART_IER_THREINT);
+		queued = true;
+	} else {
+		s_tx_stats[chnum].dropped++;
+	}
+	taskEXIT_CRITICAL();
+
+	uint32_t us = StopWatch_TicksToUs(StopWatch_Elapsed(start));
+	s_tx_stats[chnum].last_us = us;
+	if (us > s_tx_stats[chnum].max_us) s_tx_stats[chnum].max_us = us;
+	return queued;
 }
 
-static uint32_t get_setpoint_multiplier( float nominal, uint32_t num_decimals) {
-	// To convert from display value to 1/256% units for the module
-	// setpoint * multiplier >> 16
-	// where multiplier is 65536 * 25600 / (nominal * scale_factor)
-	return (uint32_t)((65536.0f * 25600.0f / (nominal * (float)num_dec_2_scale_factor(num_decimals))) + 0.5f);
+static void uart_irq(uint32_t chnum) {
+	LPC_USART_T* pUART = CHx_UART(chnum);
+
+	if (pUART->IER & UART_IER_THREINT) {
+		uart_tx_fill(pUART, &s_txring[chnum]);
+		if (RingBuffer_IsEmpty(&s_txring[chnum])) {
+			Chip_UART_IntDisable(pUART, UART_IER_THREINT);
+		}
+	}
+
+	int rxcount = RingBuffer_GetCount(&s_rxring[chnum]);
+	Chip_UART_RXIntHandlerRB(pUART, &s_rxring[chnum]);
+
+	// Only wake ps_task when something was received
+	if (RingBuffer_GetCount(&s_rxring[chnum]) != rxcount) {
+		BaseType_t woken = pdFALSE;
+		vTaskNotifyGiveFromISR(s_ps_task_handle, &woken);
+		portYIELD_FROM_ISR(woken);
+	}
 }
 
-static void populate_psdata(float nominal, conversions_t id) {
+void UART0_IRQHandler(void) {
+	uart_irq(0);
+}
+
+void UART1_IRQHandler(void) {
+	uart_irq(1);
+}
+
+static void populate_psdata(const float* nominal, conversions_t id) {
 	switch (id) {
 	case CONVERSION_VOLTAGE:
 	case CONVERSION_CURRENT:
-		s_psdata[id].num_decimals = get_num_decimals(nominal);
-		s_psdata[id].max_setpoint = (uint32_t)((nominal * (float)num_dec_2_scale_factor(s_psdata[id].num_decimals)) + 0.5f);
-		s_psdata[id].mult_readback = get_readback_multiplier(nominal, s_psdata[id].num_decimals);
-		s_psdata[id].mult_setpoint = get_setpoint_multiplier(nominal, s_psdata[id].num_decimals);
+		s_psdata[id].num_decimals = psconv_num_decimals(nominal);
+		s_psdata[id].max_setpoint = psconv_nominal_round(nominal, psconv_scale_factor(s_psdata[id].num_decimals));
 		break;
 	case CONVERSION_POWER:
 		s_psdata[id].num_decimals = s_psdata[CONVERSION_VOLTAGE].num_decimals + s_psdata[CONVERSION_CURRENT].num_decimals;
-		s_psdata[id].max_setpoint = (uint32_t)((nominal * (float)num_dec_2_scale_factor(s_psdata[id].num_decimals)) + 0.5f);
-		s_psdata[id].mult_readback = 0;
-		s_psdata[id].mult_setpoint = 0;
+		s_psdata[id].max_setpoint = psconv_nominal_round(nominal, psconv_scale_factor(s_psdata[id].num_decimals));
 		break;
 	default:
 		;
 	}
 }
 
+// The riser uses 1/256% units, see psconv.c
 static uint32_t ps_display_to_percent_setpoint(uint32_t disp, conversions_t type) {
-	return ((s_psdata[type].mult_setpoint * disp) + 32768) >> 16;
+	return psconv_to_percent(disp, s_psdata[type].max_setpoint);
 }
 
-static uint32_t ps_percent_to_display_readback(uint32_t percent, conversions_t type) {
-	return ((s_psdata[type].mult_readback * percent) + 32768) >> 16;
+uint32_t ps_percent_to_display_readback(uint32_t percent, conversions_t type) {
+	return psconv_to_display(percent, s_psdata[type].max_setpoint);
 }
 
 static uint32_t s_initneeded[NUM_CHANNELS];
 
+// Requests in flight per channel, oldest first. The riser answers requests in order and
+// writes each response straight into its 16 byte tx fifo without checking for space, so
+// requests are only pipelined while all their responses fit the fifo together. Two
+// setpoints (8 byte readback each) can be in flight, a get (up to 16 bytes) goes alone.
+#define MAX_INFLIGHT (2)
+#define RISER_TX_FIFO (16)
+#define RESPONSE_TIMEOUT_MS (10)
+#define MAX_RETRIES (2)
+
+typedef struct {
+	uint8_t frame[16];
+	uint8_t len;
+	uint8_t retries;
+	uint8_t resp_max; // Longest response the riser may send
+	uint32_t sent; // StopWatch ticks
+} xfer_t;
+
+typedef struct {
+	xfer_t inflight[MAX_INFLIGHT];
+	uint32_t num_inflight;
+	bool setpoint_pending;
+	TickType_t last_setpoint;
+	bool id_check; // Setpoints are held until the riser has confirmed its image id
+	TickType_t id_check_since;
+	TickType_t last_id_check;
+	ps_xfer_stats_t stats;
+} chxfer_t;
+
+// Setpoints are sent as soon as they change. Unchanged setpoints are resent at the poll
+// interval, this is what refreshes the readback and it also keeps the riser link timeout
+// (100ms by default) from turning the output off
+#define POLL_INTERVAL_DEFAULT_MS (50)
+#define POLL_INTERVAL_MIN_MS (5)
+#define POLL_INTERVAL_MAX_MS (50)
+static uint32_t s_poll_interval_ms = POLL_INTERVAL_DEFAULT_MS;
+
+static chxfer_t s_xfer[NUM_CHANNELS];
+
+// A riser watchdog reset brings up the original firmware from the riser flash. It would
+// take the setpoints as usual (turning the output on again) but can't report why it
+// was reset. After any lost frame, and at the interval below, the image id is checked
+// before more setpoints are sent. A riser not running this image is reloaded, as is one
+// not answering at all for longer than its link timeout (the output is off by then).
+#define ID_CHECK_INTERVAL_MS (1000)
+#define ID_CHECK_GIVEUP_MS (150)
+static uint32_t s_reload_request = 0; // Channels to reload, only touched by ps_task
+static uint32_t s_reloading = 0;
+// Riser found running another image, reported as a watchdog trip until the output is
+// turned on again (like the riser's own trip reasons) as the riser can't tell after the
+// reset and reload
+static uint32_t s_reverted = 0;
+
+const uint32_t ps_rtt_bucket_us[PS_RTT_BUCKETS] = {250, 500, 1000, 2000, 5000, 0xffffffff};
+
+static bool xfer_is_setpoint(const uint8_t* frame) {
+	return (frame[0] & 0xf0) == 0x10;
+}
+
+static bool xfer_matches(const uint8_t* req, const uint8_t* resp) {
+	if ((req[0] & 0xf0) != (resp[0] & 0xf0)) return false;
+	if ((req[0] & 0xf0) == 0x80) {
+		if ((req[0] & 0xf) == 2) return req[1] == resp[1]; // Get echoes the object id
+		return (resp[0] & 0xf) == 1; // Set is acknowledged with an empty response
+	}
+	return true;
+}
+
+static uint32_t xfer_resp_max(const uint8_t* frame) {
+	if (xfer_is_setpoint(frame)) return 8; // Readback
+	if ((frame[0] & 0xf) == 2) return RISER_TX_FIFO; // Get, length depends on the object
+	return 2; // Set acknowledge
+}
+
+static bool xfer_send(uint32_t chnum, const uint8_t* frame, uint32_t len, uint32_t retries) {
+	chxfer_t* x = &s_xfer[chnum];
+	if (x->num_inflight >= MAX_INFLIGHT) return false;
+	uint32_t resp_max = xfer_resp_max(frame);
+	for (uint32_t i = 0; i < x->num_inflight; i++) {
+		resp_max += x->inflight[i].resp_max;
+	}
+	if (resp_max > RISER_TX_FIFO) return false;
+	if (!uart_send(chnum, frame, len)) return false;
+
+	xfer_t* t = &x->inflight[x->num_inflight++];
+	memcpy(t->frame, frame, len);
+	t->len = len;
+	t->retries = retries;
+	t->resp_max = xfer_resp_max(frame);
+	t->sent = StopWatch_Start();
+	x->stats.sent++;
+	return true;
+}
+
+static void id_check_start(uint32_t chnum) {
+	chxfer_t* x = &s_xfer[chnum];
+	if (x->id_check) return;
+	x->id_check = true;
+	x->id_check_since = xTaskGetTickCount();
+}
+
+static void xfer_remove(chxfer_t* x, uint32_t idx) {
+	x->num_inflight--;
+	for (uint32_t i = idx; i < x->num_inflight; i++) {
+		x->inflight[i] = x->inflight[i + 1];
+	}
+}
+
+// No response for the request at idx, send it again unless out of retries
+static void xfer_lost(uint32_t chnum, uint32_t idx) {
+	chxfer_t* x = &s_xfer[chnum];
+	xfer_t t = x->inflight[idx];
+	xfer_remove(x, idx);
+	x->stats.timeout++;
+	if (xfer_is_setpoint(t.frame)) {
+		// Resend the latest setpoint rather than the lost one
+		x->setpoint_pending = true;
+		x->stats.retries++;
+	} else if (t.retries < MAX_RETRIES && xfer_send(chnum, t.frame, t.len, t.retries + 1)) {
+		x->stats.retries++;
+	} else if (t.frame[0] == 0x82 && t.frame[1] == OBJ_IMAGE_ID &&
+			(xTaskGetTickCount() - x->id_check_since) >= ID_CHECK_GIVEUP_MS) {
+		s_reload_request |= _BV(chnum);
+	}
+	// Could be the riser restarting
+	id_check_start(chnum);
+}
+
+static void xfer_response(uint32_t chnum, const uint8_t* resp) {
+	chxfer_t* x = &s_xfer[chnum];
+	uint32_t i;
+	for (i = 0; i < x->num_inflight; i++) {
+		if (xfer_matches(x->inflight[i].frame, resp)) break;
+	}
+	if (i == x->num_inflight) {
+		x->stats.unexpected++;
+		return;
+	}
+
+	uint32_t us = StopWatch_TicksToUs(StopWatch_Elapsed(x->inflight[i].sent));
+	uint32_t bucket = 0;
+	while (us >= ps_rtt_bucket_us[bucket] && bucket < (PS_RTT_BUCKETS - 1)) bucket++;
+	x->stats.rtt_hist[bucket]++;
+	x->stats.ok++;
+	xfer_remove(x, i);
+
+	// As responses arrive in order anything sent before this request was lost
+	while (i--) {
+		xfer_lost(chnum, 0);
+	}
+}
+
+static void xfer_check_timeout(uint32_t chnum) {
+	chxfer_t* x = &s_xfer[chnum];
+	if (x->num_inflight && StopWatch_Elapsed(x->inflight[0].sent) >= StopWatch_MsToTicks(RESPONSE_TIMEOUT_MS)) {
+		xfer_lost(chnum, 0);
+	}
+}
+
+static bool xfer_obj_inflight(uint32_t chnum, uint32_t objid) {
+	chxfer_t* x = &s_xfer[chnum];
+	for (uint32_t i = 0; i < x->num_inflight; i++) {
+		if (x->inflight[i].frame[0] == 0x82 && x->inflight[i].frame[1] == objid) return true;
+	}
+	return false;
+}
+
 static void parse_rxbuf(uint32_t chnum) {
-	uint32_t numbytes = s_chinfo_rw[chnum].numrx;
 	uint8_t* buf_p = s_chinfo_rw[chnum].rxbuf;
-	uint32_t cksum = 0xff & calc_checksum(buf_p, numbytes - 1);
-	if ((buf_p[0] & 0xf) == numbytes - 1 && cksum == buf_p[numbytes - 1]) {
-		// Parse response
-		switch (buf_p[0] & 0xf0) {
-		case 0x10:
-			s_chinfo_rw[chnum].status = buf_p[6] << 8 | buf_p[1];
-			s_chinfo_rw[chnum].volt_readback_percent = buf_p[2] << 8 | buf_p[3];
-			s_chinfo_rw[chnum].curr_readback_percent = buf_p[4] << 8 | buf_p[5];
+	xfer_response(chnum, buf_p);
+
+	switch (buf_p[0] & 0xf0) {
+	case 0x10:
+	{
+		snapshot_pub_t* pub = &s_snapshot[chnum];
+		uint32_t seq = pub->seq + 1;
+		ps_snapshot_t* snap = &pub->buf[seq & 1];
+		snap->status = buf_p[6] << 8 | buf_p[1];
+		if ((snap->status & STATUS_OUTPUT_ON) && !(s_reload_request & _BV(chnum))) s_reverted &= ~_BV(chnum);
+		if (s_reverted & _BV(chnum)) snap->status |= STATUS_TRIP_WATCHDOG;
+		snap->volt_percent = buf_p[2] << 8 | buf_p[3];
+		snap->curr_percent = buf_p[4] << 8 | buf_p[5];
+		snap->timestamp = xTaskGetTickCount();
+		__DMB();
+		pub->seq = seq;
+		EventBits_t bits = 0;
+		for (uint32_t l = 0; l < PS_NUM_LISTENERS; l++) {
+			bits |= _BV(chnum) << (l * NUM_CHANNELS);
+		}
+		xEventGroupSetBits(s_readback_events, bits);
+		ui_post_event(UI_EVT_READBACK);
+		boot_mark(BOOT_FIRST_READBACK);
+		hist_add(chnum, snap->volt_percent, snap->curr_percent);
+		energy_add(chnum, snap->volt_percent, snap->curr_percent);
+		break;
+	}
+	case 0x80:
+		if ((buf_p[0] & 0xf) < 2) break; // Set acknowledge
+		switch (buf_p[1]) {
+		case 0x09:
+		case 0x0a:
+		{
+			// The first setpoint frame sends these back unchanged
+			chinfo_rw_t* ch = &s_chinfo_rw[chnum];
+			uint32_t percent = buf_p[2] << 8 | buf_p[3];
+			taskENTER_CRITICAL();
+			if (buf_p[1] == 0x09) {
+				ch->volt_setpoint_percent = percent;
+				ch->volt_setpoint = ps_percent_to_display_readback(percent, CONVERSION_VOLTAGE);
+			} else {
+				ch->curr_setpoint_percent = percent;
+				ch->curr_setpoint = ps_percent_to_display_readback(percent, CONVERSION_CURRENT);
+			}
+			taskEXIT_CRITICAL();
 			break;
-		case 0x80:
-			switch (buf_p[1]) {
-			case 0x09:
-				s_chinfo_rw[chnum].volt_setpoint = ps_percent_to_display_readback(buf_p[2] << 8 | buf_p[3], CONVERSION_VOLTAGE);
-				break;
-			case 0x0a:
-				s_chinfo_rw[chnum].curr_setpoint = ps_percent_to_display_readback(buf_p[2] << 8 | buf_p[3], CONVERSION_CURRENT);
-				break;
+		}
+		case OBJ_IMAGE_ID:
+			if ((buf_p[0] & 0xf) == 6 && ((uint32_t)buf_p[2] << 24 | buf_p[3] << 16 | buf_p[4] << 8 | buf_p[5]) == isp_image_id()) {
+				s_xfer[chnum].id_check = false;
+			} else {
+				// Answered, so reset and running from the riser flash
+				s_reverted |= _BV(chnum);
+				s_reload_request |= _BV(chnum);
 			}
-			s_initneeded[chnum] &= ~_BV(buf_p[1]);
 			break;
 		}
-		s_chinfo_rw[chnum].numrx = 0;
+		if (buf_p[1] < 32) s_initneeded[chnum] &= ~_BV(buf_p[1]);
+		break;
+	}
+}
+
+// Frames are type+length byte (length excluding the first byte), payload and checksum
+static void rx_byte(uint32_t chnum, uint8_t byte) {
+	chinfo_rw_t* ch = &s_chinfo_rw[chnum];
+	if (ch->numrx == 0 && (byte & 0xf) == 0) return; // Can't be the start of a frame
+
+	ch->rxbuf[ch->numrx++] = byte;
+	if (ch->numrx == (ch->rxbuf[0] & 0xf) + 1) {
+		if ((uint8_t)calc_checksum(ch->rxbuf, ch->numrx - 1) == ch->rxbuf[ch->numrx - 1]) {
+			parse_rxbuf(chnum);
+		} else {
+			s_xfer[chnum].stats.cksum_err++;
+		}
+		ch->numrx = 0;
 	}
 }
 
-static void ps_send_request(uint32_t chnum, uint32_t objid) {
-	if (s_is_isp || chnum >= NUM_CHANNELS) return;
+static bool ps_send_request(uint32_t chnum, uint32_t objid) {
+	if (s_is_isp || chnum >= NUM_CHANNELS) return false;
 
 	uint8_t tmpcmd[] = {0x82, objid, 0x00};
 	uint32_t size = sizeof(tmpcmd);
 	uint8_t cksum = (uint8_t)calc_checksum(tmpcmd, size - 1);
 	tmpcmd[size - 1] = cksum;
-	s_chinfo_rw[chnum].numrx = 0;
-	Chip_UART_SendBlocking(CHx_UART(chnum), tmpcmd, sizeof(tmpcmd));
+	return xfer_send(chnum, tmpcmd, sizeof(tmpcmd), 0);
+}
+
+static bool ps_set_setpoints_percent(uint32_t chnum, uint32_t voltage, uint32_t current, bool onoff) {
+	if (s_is_isp || chnum >= NUM_CHANNELS) return false;
+
+	uint8_t tmpcmd[] = {0x16, onoff, voltage >> 8, voltage & 0xff, current >> 8, current & 0xff, 0x00};
+	uint32_t size = sizeof(tmpcmd);
+	uint8_t cksum = (uint8_t)calc_checksum(tmpcmd, size - 1);
+	tmpcmd[size - 1] = cksum;
+	return xfer_send(chnum, tmpcmd, sizeof(tmpcmd), 0);
+}
+
+static void send_pending_setpoint(uint32_t chnum) {
+	chinfo_rw_t* ch = &s_chinfo_rw[chnum];
+	if (!s_xfer[chnum].setpoint_pending) return;
+
+	taskENTER_CRITICAL();
+	uint32_t volt = ch->volt_setpoint_percent;
+	uint32_t curr = ch->curr_setpoint_percent;
+	bool onoff = ch->onoff;
+	s_xfer[chnum].setpoint_pending = false;
+	taskEXIT_CRITICAL();
+
+	if (ps_set_setpoints_percent(chnum, volt, curr, onoff)) {
+		s_xfer[chnum].last_setpoint = xTaskGetTickCount();
+	} else {
+		s_xfer[chnum].setpoint_pending = true; // Try again when a response has arrived
+	}
+}
+
+static void send_init_request(uint32_t chnum) {
+	uint32_t tmp = s_initneeded[chnum];
+	uint32_t objid = 0;
+	// Find first bit set which isn't already requested
+	while (objid < 32 && (!(tmp & 1) || xfer_obj_inflight(chnum, objid))) {
+		objid++;
+		tmp >>= 1;
+	}
+	if (objid < 32) {
+		ps_send_request(chnum, objid);
+	}
+}
+
+static void send_id_check(uint32_t chnum) {
+	chxfer_t* x = &s_xfer[chnum];
+	if (!xfer_obj_inflight(chnum, OBJ_IMAGE_ID) && ps_send_request(chnum, OBJ_IMAGE_ID)) {
+		x->last_id_check = xTaskGetTickCount();
+	}
+}
+
+// The UART is handed over to isputils while the riser is loaded, the other channels keep
+// running. The output is off after the reset, the user has to turn it on again.
+static void reload_start(uint32_t chnum) {
+	LPC_USART_T* pUART = CHx_UART(chnum);
+	NVIC_DisableIRQ(chnum ? UART1_IRQn : UART0_IRQn);
+	Chip_UART_IntDisable(pUART, UART_IER_RBRINT | UART_IER_THREINT);
+
+	chxfer_t* x = &s_xfer[chnum];
+	x->num_inflight = 0;
+	x->setpoint_pending = false;
+	x->id_check = false;
+	s_initneeded[chnum] = _BV(9) | _BV(10);
+	taskENTER_CRITICAL();
+	s_chinfo_rw[chnum].onoff = false;
+	taskEXIT_CRITICAL();
+
+	// No module communication until loaded
+	snapshot_pub_t* pub = &s_snapshot[chnum];
+	uint32_t seq = pub->seq + 1;
+	pub->buf[seq & 1].status = 0xffffffff;
+	__DMB();
+	pub->seq = seq;
+	ui_post_event(UI_EVT_READBACK);
+
+	s_reload_request &= ~_BV(chnum);
+	s_reloading |= _BV(chnum);
+	isp_start(_BV(chnum));
 }
 
 static void ps_task( void* pvParameters ) {
 // Either we RAM-load firmware or let the modules boot from internal flash
 #if 1
+	boot_mark(BOOT_TASKS);
 	s_is_isp = true;
-	isp_mode();
+	// Risers already running this image (front panel restart) are left alone
+	uint32_t live = isp_probe_running(ALL_CHANNELS_MASK);
+	boot_mark(BOOT_PROBED);
+	if (live != ALL_CHANNELS_MASK) live |= isp_mode(ALL_CHANNELS_MASK & ~live);
 #else
+	// Modules booting from flash can't be probed through ISP, channels that never answer
+	// will show dashes instead
+	uint32_t live = ALL_CHANNELS_MASK;
 	for (int i = 0; i < NUM_CHANNELS; i++) {
 		// Set reset pin low (reset supervisor will bring reset low immediately)
 		CHx_RESET(i, 0);
@@ -166,43 +561,71 @@ static void ps_task( void* pvParameters ) {
 	}
 	vTaskDelay(310);
 #endif
+	for (int i = 0; i < NUM_CHANNELS; i++) {
+		if (live & _BV(i)) uart_rx_int_enable(i);
+	}
+	s_live_mask = live;
 	s_is_isp = false;
+	boot_mark(BOOT_RISERS_UP);
+	bool ready = false;
+	bool reload_streaming = false;
 
 	while (1) {
+		// Sleep until something has been received or a new setpoint is to be sent, but wake up
+		// regularly to handle response timeouts. While a riser is being loaded isputils may
+		// need to poll its UART without sleeping.
+		if (reload_streaming) {
+			taskYIELD();
+		} else {
+			ulTaskNotifyTake(pdTRUE, 1);
+		}
+
+		if (s_reloading && !isp_service(&reload_streaming)) {
+			uint32_t done = isp_done_mask(s_reloading);
+			for (int i = 0; i < NUM_CHANNELS; i++) {
+				if (done & _BV(i)) uart_rx_int_enable(i);
+			}
+			// Risers that failed are held in reset
+			live &= ~(s_reloading & ~done);
+			s_live_mask = live;
+			s_reloading = 0;
+			reload_streaming = false;
+		}
+
 		for (int i = 0; i < NUM_CHANNELS; i++) {
+			if (s_reload_request & _BV(i)) reload_start(i);
+			if (!(live & _BV(i)) || (s_reloading & _BV(i))) continue;
+			uint8_t tmp;
+			while (RingBuffer_Pop(&s_rxring[i], &tmp)) {
+				rx_byte(i, tmp);
+			}
+			xfer_check_timeout(i);
 			if (s_initneeded[i]) {
-				uint32_t tmp = s_initneeded[i];
-				uint32_t objid = 0;
-				// Find first bit set
-				while (objid < 32 && !(tmp & 1)) {
-					objid++;
-					tmp >>= 1;
-				}
-				if (objid < 32) {
-					ps_send_request(i, objid);
-				}
-				vTaskDelay(2);
+				// No setpoint goes out before the riser's own are known, it would get zeros
+				send_init_request(i);
+				continue;
+			}
+			if ((xTaskGetTickCount() - s_xfer[i].last_id_check) >= ID_CHECK_INTERVAL_MS) id_check_start(i);
+			if (s_xfer[i].id_check) {
+				send_id_check(i);
+				continue;
 			}
+			if ((xTaskGetTickCount() - s_xfer[i].last_setpoint) >= s_poll_interval_ms) {
+				s_xfer[i].setpoint_pending = true;
+			}
+			send_pending_setpoint(i);
 		}
-		for (int i = 0; i < NUM_CHANNELS; i++) {
-			LPC_USART_T* pUART = CHx_UART(i);
 
-			uint8_t tmp;
-			uint32_t num;
-			do {
-				num = Chip_UART_Read(pUART, &tmp, 1);
-				if (!num) num = Chip_UART_Read(pUART, &tmp, 1);
-				if (num > 0) {
-					if (s_chinfo_rw[i].numrx < 16) {
-						s_chinfo_rw[i].rxbuf[s_chinfo_rw[i].numrx++] = tmp;
-						if (s_chinfo_rw[i].numrx > 3) {
-							parse_rxbuf(i);
-						}
-					}
-				}
-			} while (num > 0);
+		if (!ready) {
+			ready = true;
+			for (int i = 0; i < NUM_CHANNELS; i++) {
+				if ((live & _BV(i)) && s_initneeded[i]) ready = false;
+			}
+			if (ready) {
+				boot_mark(BOOT_INIT_DONE);
+				xEventGroupSetBits(s_readback_events, READY_BIT);
+			}
 		}
-		vTaskDelay(1);
 	}
 }
 
@@ -214,27 +637,27 @@ void ps_init(void) {
 	// is determined by the maximum voltage/current. With a scale factor of 1 no decimals
 	// are shown, up to a maximum scale factor of 1000 which will display three decimals.
 
-	populate_psdata( FLASH_CAL->FLOAT_NOMINAL_VOLTAGE, CONVERSION_VOLTAGE );
-	populate_psdata( FLASH_CAL->FLOAT_NOMINAL_CURRENT, CONVERSION_CURRENT );
+	populate_psdata( &FLASH_CAL->FLOAT_NOMINAL_VOLTAGE, CONVERSION_VOLTAGE );
+	populate_psdata( &FLASH_CAL->FLOAT_NOMINAL_CURRENT, CONVERSION_CURRENT );
 
 	// The maximum power needs to be kept below the nominal value.
 	// Calculate the maximum power in display values to easier be able to compare (and limit)
 	// by simply and cheaply multiply display values of voltage and current, then compare with
 	// this value
 
-	populate_psdata( FLASH_CAL->FLOAT_NOMINAL_POWER, CONVERSION_POWER );
+	populate_psdata( &FLASH_CAL->FLOAT_NOMINAL_POWER, CONVERSION_POWER );
+	hist_init();
+	s_readback_events = xEventGroupCreate();
+	energy_init();
 
 	for (int i = 0; i < NUM_CHANNELS; i++) {
 		uart_setup(i, 500000);
-		// Set ISP pin high (don't request ISP mode) for now
-		CHx_ISP(i, 1);
-
-		// Make sure module stays in reset until we decide what to do with it
-		CHx_RESET(i, 0);
+		// Reset and ISP pins are kept high from boot so a riser still running from before
+		// a front panel restart isn't disturbed, ps_task decides what to do with it
 
 		// Request id 9 and 10 from modules (voltage and current setpoints) on startup
 		s_initneeded[i] = _BV(9) | _BV(10);
-		s_chinfo_rw[i].status = 0xffffffff;
+		s_snapshot[i].buf[0].status = 0xffffffff;
 	}
 
 	xTaskCreate( ps_task,            /* The function that implements the task. */
@@ -242,7 +665,7 @@ void ps_init(void) {
                 configMINIMAL_STACK_SIZE,        /* The size of the stack to allocate to the task. */
                 NULL,                            /* The parameter passed to the task - not used in this case. */
 				configMAX_PRIORITIES - 3, /* The priority assigned to the task. */
-                NULL );                          /* The task handle is not required, so NULL is passed. */
+                &s_ps_task_handle );             /* Handle used by the UART interrupts to wake the task. */
 
 }
 
@@ -250,39 +673,66 @@ const conversion_info_t* ps_get_conv_info_ptr(void) {
 	return s_psdata;
 }
 
-static void ps_set_setpoints_percent(uint32_t chnum, uint32_t voltage, uint32_t current, bool onoff) {
-	if (s_is_isp || chnum >= NUM_CHANNELS) return;
-
-	uint8_t tmpcmd[] = {0x16, onoff, voltage >> 8, voltage & 0xff, current >> 8, current & 0xff, 0x00};
-	uint32_t size = sizeof(tmpcmd);
-	uint8_t cksum = (uint8_t)calc_checksum(tmpcmd, size - 1);
-	tmpcmd[size - 1] = cksum;
-	s_chinfo_rw[chnum].numrx = 0;
-	Chip_UART_SendBlocking(CHx_UART(chnum), tmpcmd, sizeof(tmpcmd));
+// Consistent copy of status and readback from the same response, never blocks
+void ps_get_snapshot(uint32_t chnum, ps_snapshot_t* snap) {
+	snapshot_pub_t* pub = &s_snapshot[chnum];
+	uint32_t seq;
+	do {
+		seq = pub->seq;
+		__DMB();
+		*snap = pub->buf[seq & 1];
+		__DMB();
+	} while (seq != pub->seq);
 }
 
 static uint32_t ps_get_readback_percent(uint32_t chnum, conversions_t type) {
 	if (chnum >= NUM_CHANNELS) return 0;
+	ps_snapshot_t snap;
+	ps_get_snapshot(chnum, &snap);
 	uint32_t result = 0;
 	switch (type) {
 		case CONVERSION_VOLTAGE:
-			result = s_chinfo_rw[chnum].volt_readback_percent;
+			result = snap.volt_percent;
 			break;
 		case CONVERSION_CURRENT:
-			result = s_chinfo_rw[chnum].curr_readback_percent;
+			result = snap.curr_percent;
 			break;
 	}
 	return result;
 }
 
+// Setpoints are sent by ps_task which owns the riser link, it is only woken up if
+// something actually changed
 void ps_set_setpoints(uint32_t chnum, uint32_t voltage, uint32_t current, bool onoff) {
-
-	s_chinfo_rw[chnum].volt_setpoint = voltage;
-	s_chinfo_rw[chnum].curr_setpoint = current;
+	if (chnum >= NUM_CHANNELS) return;
+	chinfo_rw_t* ch = &s_chinfo_rw[chnum];
 
 	uint32_t volt_percent = ps_display_to_percent_setpoint(voltage, CONVERSION_VOLTAGE);
 	uint32_t curr_percent = ps_display_to_percent_setpoint(current, CONVERSION_CURRENT);
-	ps_set_setpoints_percent(chnum, volt_percent, curr_percent, onoff);
+
+	taskENTER_CRITICAL();
+	ch->volt_setpoint = voltage;
+	ch->curr_setpoint = current;
+	bool changed = ch->volt_setpoint_percent != volt_percent ||
+			ch->curr_setpoint_percent != curr_percent || ch->onoff != onoff;
+	if (changed) {
+		ch->volt_setpoint_percent = volt_percent;
+		ch->curr_setpoint_percent = curr_percent;
+		ch->onoff = onoff;
+		s_xfer[chnum].setpoint_pending = true;
+	}
+	taskEXIT_CRITICAL();
+	if (changed) xTaskNotifyGive(s_ps_task_handle);
+}
+
+void ps_set_poll_interval(uint32_t ms) {
+	if (ms < POLL_INTERVAL_MIN_MS) ms = POLL_INTERVAL_MIN_MS;
+	if (ms > POLL_INTERVAL_MAX_MS) ms = POLL_INTERVAL_MAX_MS;
+	s_poll_interval_ms = ms;
+}
+
+uint32_t ps_get_poll_interval(void) {
+	return s_poll_interval_ms;
 }
 
 uint32_t ps_get_readback(uint32_t chnum, conversions_t type) {
@@ -300,6 +750,42 @@ uint32_t ps_get_setpoint(uint32_t chnum, conversions_t id) {
 	}
 }
 
+// Block until new readback has arrived on any of the channels in chmask, or timeout.
+// Returns the channels with new readback since the listener last waited.
+uint32_t ps_wait_readback(ps_listener_t listener, uint32_t chmask, TickType_t timeout) {
+	if (!chmask) {
+		vTaskDelay(timeout);
+		return 0;
+	}
+	uint32_t shift = listener * NUM_CHANNELS;
+	EventBits_t bits = xEventGroupWaitBits(s_readback_events, chmask << shift, pdTRUE, pdFALSE, timeout);
+	return (bits >> shift) & chmask;
+}
+
+// Waits until the risers are up and the setpoints of all live channels have been fetched,
+// returns false on timeout
+bool ps_wait_ready(TickType_t timeout) {
+	return (xEventGroupWaitBits(s_readback_events, READY_BIT, pdFALSE, pdTRUE, timeout) & READY_BIT) != 0;
+}
+
+bool ps_channel_live(uint32_t chnum) {
+	return chnum < NUM_CHANNELS && (s_live_mask & _BV(chnum));
+}
+
+uint32_t ps_get_live_mask(void) {
+	return s_live_mask;
+}
+
 uint32_t ps_get_status(uint32_t chnum) {
-	return s_chinfo_rw[chnum].status;
+	ps_snapshot_t snap;
+	ps_get_snapshot(chnum, &snap);
+	return snap.status;
+}
+
+const ps_tx_stats_t* ps_get_tx_stats(uint32_t chnum) {
+	return &s_tx_stats[chnum];
+}
+
+const ps_xfer_stats_t* ps_get_xfer_stats(uint32_t chnum) {
+	return &s_xfer[chnum].stats;
 }
@@ -2,6 +2,8 @@
 #define POWERSUPPLY_H_
 
 #include <stdint.h>
+#include "FreeRTOS.h"
+#include "psconv.h"
 
 typedef enum {
 	CONVERSION_VOLTAGE = 0,
@@ -11,9 +13,7 @@ typedef enum {
 } conversions_t;
 
 typedef struct {
-	uint32_t mult_readback;
-	uint32_t mult_setpoint;
-	uint32_t max_setpoint; // In display units
+	uint32_t max_setpoint; // In display units, same as the nominal value
 	uint32_t num_decimals;
 } conversion_info_t;
 
@@ -55,18 +55,84 @@ Request 12 (?) : 0x00 0x01 0x0d 0xa0 0x00 0x00 0x00 0x00 69024 0 dec temperature
 Request 13 (?) : 0x00 0x01 0x00 0x00 0x00 0x00 0x02 0x00 65536 512 dec ad ch0 related
 Request 14 (?) : 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0 0 dec this is related to ad ch6 but not saved in caldata in ee pc obj 0x58
 Request 15 (?) : 0x10 0xbe 4286 dec (max power?)
+
+Objects below are only implemented by the open riser firmware
+Request 40 : UART ISR cycles, count (32-bit) min (16-bit) avg (16-bit) max (32-bit), set resets
+Request 41 : ADC ISR cycles, same layout as 40
+Request 42 : Request to response turnaround cycles, last (32-bit) worst (32-bit)
+Request 48 : Trip reason (same bits as the second status byte >> 8), set clears
+Request 49 : Link timeout in ms (16-bit), output turned off if no setpoint is received in time, 0 disables
+Request 50 : Temperature in 1/256 degC (signed 16-bit), calibrated temperature reading (16-bit)
+Request 51 : Warning, trip and release temperature in 1/256 degC (signed 16-bit each), warn <= trip and release < trip
+Request 52 : Temperature conversion, reading at reference, reference temperature (1/256 degC), degC per reading (Q16),
+             get adds a flag (8-bit) that is 0 until set. The degC of 50/51 are UNCALIBRATED until then, the
+             defaults only put the oem trip point at 80 with a made up 0.01 per reading step
  */
 
 #define STATUS_OVERTEMP _BV(7)
 #define STATUS_MODE_MASK (_BV(2) | _BV(1))
 #define STATUS_CC _BV(2)
 #define STATUS_OUTPUT_ON _BV(0)
+// Second status byte (open riser firmware only), trip reason until the output is turned on again
+#define STATUS_TRIP_LINK_TIMEOUT _BV(8)
+#define STATUS_TRIP_WATCHDOG _BV(9) // Also set by the front panel after reloading a riser found reset
+#define STATUS_TEMP_WARNING _BV(10) // Temperature in the warning band below the over-temperature trip
+
+// Time the caller spends queueing frames for transmission, uart_send never waits for the
+// line. blocking_us is what the blocking send used before spent on the longest frame.
+typedef struct {
+	uint32_t last_us;
+	uint32_t max_us;
+	uint32_t blocking_us;
+	uint32_t dropped; // Frames not sent due to a full tx queue
+} ps_tx_stats_t;
+
+// Status and readback (riser percent units) from one response, timestamp in ticks
+typedef struct {
+	uint32_t status;
+	uint16_t volt_percent;
+	uint16_t curr_percent;
+	uint32_t timestamp;
+} ps_snapshot_t;
+
+// Consumers of new readback events, each gets its own copy of the events
+// (PS_NUM_LISTENERS * NUM_CHANNELS plus the ready bit must fit in the 24 event group bits)
+typedef enum {
+	PS_LISTENER_UI = 0,
+	PS_LISTENER_USB,
+	PS_NUM_LISTENERS
+} ps_listener_t;
+
+// Riser request/response statistics, round-trip times are counted in buckets
+// with upper limits (exclusive) in ps_rtt_bucket_us
+#define PS_RTT_BUCKETS (6)
+typedef struct {
+	uint32_t sent; // Including retries
+	uint32_t ok;
+	uint32_t timeout;
+	uint32_t retries;
+	uint32_t cksum_err;
+	uint32_t unexpected; // Valid responses not matching any request in flight
+	uint32_t rtt_hist[PS_RTT_BUCKETS];
+} ps_xfer_stats_t;
+
+extern const uint32_t ps_rtt_bucket_us[PS_RTT_BUCKETS];
 
 void ps_init(void);
 const conversion_info_t* ps_get_conv_info_ptr(void);
 void ps_set_setpoints(uint32_t chnum, uint32_t voltage, uint32_t current, bool onoff);
 uint32_t ps_get_readback(uint32_t chnum, conversions_t type);
+uint32_t ps_percent_to_display_readback(uint32_t percent, conversions_t type);
 uint32_t ps_get_setpoint(uint32_t chnum, conversions_t type);
 uint32_t ps_get_status(uint32_t chnum);
+bool ps_channel_live(uint32_t chnum);
+uint32_t ps_get_live_mask(void); // Zero until the risers have been probed at boot
+void ps_get_snapshot(uint32_t chnum, ps_snapshot_t* snap);
+uint32_t ps_wait_readback(ps_listener_t listener, uint32_t chmask, TickType_t timeout);
+bool ps_wait_ready(TickType_t timeout);
+const ps_tx_stats_t* ps_get_tx_stats(uint32_t chnum);
+const ps_xfer_stats_t* ps_get_xfer_stats(uint32_t chnum);
+void ps_set_poll_interval(uint32_t ms); // Readback poll/keepalive interval, clamped to 5-50ms
+uint32_t ps_get_poll_interval(void);
 
 #endif /* POWERSUPPLY_H_ */
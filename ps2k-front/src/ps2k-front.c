@@ -24,6 +24,7 @@
 #include "usb.h"
 #include "ui.h"
 #include "stopwatch.h"
+#include "boottime.h"
 
 void main( void ) __attribute__( ( noreturn ) );
 void main(void) {
@@ -31,6 +32,12 @@ void main(void) {
     // Read clock settings and update SystemCoreClock variable
     SystemCoreClockUpdate();
 
+    // Don't reset the risers by switching the pins to outputs, they may still be running
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        CHx_RESET(i, 1);
+        CHx_ISP(i, 1);
+    }
+
     LPC_GPIO[0].DIR = PORT0_DIR;
     LPC_GPIO[1].DIR = PORT1_DIR;
     LPC_GPIO[2].DIR = PORT2_DIR;
@@ -40,6 +47,8 @@ void main(void) {
     LED_TRACKING(true);
 
     StopWatch_Init();
+    boot_mark(BOOT_MAIN);
+	ui_init();
 	keypad_init();
     disp_init(DISP_BOTH);
 	ps_init();
@@ -0,0 +1,73 @@
+/*
+ * psconv.c - Conversion between display units and riser 1/256% units
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "psconv.h"
+#include <string.h>
+
+// FLASH_CAL nominal values are IEEE754 single precision floats, they are converted with
+// integer operations only as there is no FPU. Returns floor(nominal * scale), 0 if invalid.
+static uint32_t nominal_floor(const float* nominal, uint32_t scale) {
+	uint32_t bits;
+	memcpy(&bits, nominal, sizeof(bits));
+	uint32_t exp = (bits >> 23) & 0xff;
+	if ((bits & 0x80000000) || exp == 0 || exp == 0xff) return 0;
+
+	// value = mantissa * 2^(exp - 150)
+	uint64_t val = (uint64_t)((bits & 0x7fffff) | 0x800000) * scale;
+	int32_t shift = 150 - exp;
+	if (shift <= 0) return 0; // Way out of range for a power supply
+	if (shift >= 64) return 0;
+	return (uint32_t)(val >> shift);
+}
+
+uint32_t psconv_nominal_round(const float* nominal, uint32_t scale) {
+	return (nominal_floor(nominal, scale * 2) + 1) >> 1;
+}
+
+uint32_t psconv_num_decimals(const float* nominal) {
+	uint32_t integer = nominal_floor(nominal, 1);
+	uint32_t num_decimals = 0; // No decimals, good for up to 9999V
+	if (integer < 1000) num_decimals++;
+	if (integer < 100) num_decimals++;
+	if (integer < 10) num_decimals++;
+	return num_decimals;
+}
+
+uint32_t psconv_scale_factor(uint32_t num_decimals) {
+	uint32_t result = 1;
+	while (num_decimals > 0) {
+		result *= 10;
+		num_decimals--;
+	}
+	return result;
+}
+
+// PS_FULL_SCALE corresponds to the nominal value which is max_setpoint in display units.
+// Conversions are rounded rationals in both directions:
+// percent = round(disp * PS_FULL_SCALE / max_setpoint)
+// disp = round(percent * max_setpoint / PS_FULL_SCALE)
+// As max_setpoint (four digits) is less than PS_FULL_SCALE the percent rounding error
+// is less than half a display count after scaling back, so display -> percent -> display
+// is the identity. Both directions are monotonic, tools/psconvcheck.c verifies all this.
+uint32_t psconv_to_percent(uint32_t disp, uint32_t max_setpoint) {
+	if (!max_setpoint) return 0;
+	return (disp * PS_FULL_SCALE + max_setpoint / 2) / max_setpoint;
+}
+
+uint32_t psconv_to_display(uint32_t percent, uint32_t max_setpoint) {
+	return (percent * max_setpoint + PS_FULL_SCALE / 2) / PS_FULL_SCALE;
+}
@@ -0,0 +1,16 @@
+#ifndef PSCONV_H_
+#define PSCONV_H_
+
+// Only standard headers here, this is also built on the host by tools/psconvcheck.c
+#include <stdint.h>
+
+// Riser setpoints and readback are in 1/256%, 25600 is the nominal value
+#define PS_FULL_SCALE (25600)
+
+uint32_t psconv_nominal_round(const float* nominal, uint32_t scale);
+uint32_t psconv_num_decimals(const float* nominal);
+uint32_t psconv_scale_factor(uint32_t num_decimals);
+uint32_t psconv_to_percent(uint32_t disp, uint32_t max_setpoint);
+uint32_t psconv_to_display(uint32_t percent, uint32_t max_setpoint);
+
+#endif /* PSCONV_H_ */
@@ -18,21 +18,32 @@
 #include "ui.h"
 #include <FreeRTOS.h>
 #include <task.h>
+#include <queue.h>
+#include <timers.h>
 #include <string.h>
 #include "gpiomap.h"
 #include "keypad.h"
 #include "display.h"
 #include "powersupply.h"
+#include "energy.h"
+#include "boottime.h"
 
 #define ONE_STEP (50)
 #define TIMER_SHORT_PRESET (1000 / ONE_STEP)
 #define TIMER_LONG_PRESET (5000 / ONE_STEP)
+// Leave the splash as soon as the risers are up and their setpoints known instead of after
+// a fixed two seconds. The UI must not run before that as it would send zero setpoints.
+#define FAST_BOOT (1)
+#define SPLASH_MIN_MS (300)
+#define SPLASH_MAX_MS (2000)
+#define EVENT_QUEUE_LEN (8)
 
 typedef enum {
 	DISP_READBACK = 0, // Default state showing actual readback values
 	DISP_SETPOINT, // Show setpoint values (during adjust)
 	DISP_PRESET, // Show setpoint values (when pressing Preset)
 	DISP_STATUS,
+	DISP_ENERGY, // Wh and Ah since reset (toggled with Current key, Voltage key resets)
 	DISP_MAX_VAL
 } disp_t;
 
@@ -44,6 +55,7 @@ typedef struct {
 	disp_t disp;
 	uint32_t disp_timer_restart;
 	uint32_t disp_timer;
+	uint8_t shown[11]; // Last buffer sent to the display
 } ch_state_t;
 
 typedef struct {
@@ -74,6 +86,9 @@ static const ch_cfg_t s_ch_cfg[NUM_CHANNELS] = {
 	}
 };
 
+static QueueHandle_t s_events = NULL;
+static TimerHandle_t s_step_timer = NULL;
+
 // num_decimals need to control where the decimal point goes
 // If num_decimals == 0 then no decimal is shown,
 // as num_decimal is increased DP moves into DP3/DP7, DP2/DP6 and finally DP1/DP5
@@ -82,12 +97,9 @@ static const disp_glyphs_t right_dp[4] = {GLYPH_MAX, GLYPH_DP7, GLYPH_DP6, GLYPH
 
 static int32_t handle_encoder(conversions_t type, encoder_t encoder, uint32_t chnum, bool* increased, bool* changed) {
 	int32_t tmp, delta, max;
+	uint32_t align;
 	tmp = ps_get_setpoint(chnum, type);
-	delta = get_encoder_delta(encoder);
-
-	// Simple acceleration if turning knob fast
-	if (delta > 1 || delta < -1) delta *= 10;
-	if (delta > 30 || delta < -30) delta *= 5;
+	delta = get_encoder_delta(encoder, &align); // Already accelerated by the keypad ISR
 
 	// Support dynamic power limiting
 	if (increased && delta > 0) *increased = true;
@@ -96,6 +108,14 @@ static int32_t handle_encoder(conversions_t type, encoder_t encoder, uint32_t ch
 	if (changed && delta) *changed = true;
 
 	tmp += delta;
+	// Land on a multiple of the step size when turning fast, towards where we came from so
+	// the setpoint still moves. A quick reversal could leave less than a step, keep that as is.
+	if (align > 1 && (delta >= (int32_t)align || delta <= -(int32_t)align)) {
+		int32_t rem = tmp % (int32_t)align;
+		if (rem < 0) rem += align;
+		if (rem && delta > 0) tmp -= rem;
+		if (rem && delta < 0) tmp += align - rem;
+	}
 
 	max = ps_get_conv_info_ptr()[type].max_setpoint;
 	if (tmp < 0 ) tmp = 0;
@@ -104,6 +124,37 @@ static int32_t handle_encoder(conversions_t type, encoder_t encoder, uint32_t ch
 	return tmp;
 }
 
+// Fit a value in thousandths into four digits, returns the number of decimals to show
+static uint32_t fit_milli(uint32_t milli, uint32_t* val) {
+	uint32_t decimals = 3;
+	while (decimals && milli > 9999) {
+		milli /= 10;
+		decimals--;
+	}
+	*val = milli > 9999 ? 9999 : milli;
+	return decimals;
+}
+
+static void step_timer_cb(TimerHandle_t timer) {
+	ui_post_event(UI_EVT_TIMER);
+}
+
+// Must be called before the keypad interrupt is enabled and any task runs
+void ui_init(void) {
+	s_events = xQueueCreate(EVENT_QUEUE_LEN, sizeof(uint8_t));
+	s_step_timer = xTimerCreate("ui", ONE_STEP, pdTRUE, NULL, step_timer_cb);
+}
+
+void ui_post_event(ui_event_t evt) {
+	uint8_t tmp = evt;
+	xQueueSend(s_events, &tmp, 0);
+}
+
+void ui_post_event_from_isr(ui_event_t evt, BaseType_t* woken) {
+	uint8_t tmp = evt;
+	xQueueSendFromISR(s_events, &tmp, woken);
+}
+
 // Experimental front panel "UI".
 void ui_task( void* pvParameters ) {
 	const conversion_info_t* scale = ps_get_conv_info_ptr();
@@ -111,19 +162,37 @@ void ui_task( void* pvParameters ) {
     uint8_t dispbuf[11];
     char tmpbuf[9];
 
+#if FAST_BOOT
+    TickType_t splash = xTaskGetTickCount();
+#else
     vTaskDelay(1000);
+#endif
     memset (dispbuf, 0, sizeof(dispbuf));
     disp_font_str(dispbuf, 0, 8, "x UEoS x");
     disp_update(DISP_CH1, dispbuf, 8, sizeof(dispbuf));
+#if FAST_BOOT
+    ps_wait_ready(SPLASH_MAX_MS);
+    vTaskDelayUntil(&splash, SPLASH_MIN_MS);
+#else
     vTaskDelay(1000);
+#endif
+    boot_mark(BOOT_SPLASH_DONE);
     LED_TRACKING(false);
 
     ch_state_t ch_state[NUM_CHANNELS];
     memset (ch_state, 0, sizeof(ch_state));
+    xTimerStart(s_step_timer, portMAX_DELAY);
 
     while(1) {
 		static bool tracking = false;
 
+		// Sleep until there is input, readback or a display timer step, then handle
+		// everything that has queued up in one go
+		uint8_t evt;
+		xQueueReceive(s_events, &evt, portMAX_DELAY);
+		uint32_t events = _BV(evt);
+		while (xQueueReceive(s_events, &evt, 0)) events |= _BV(evt);
+
 		key_t newkeys = get_keys_pressed();
 		if (newkeys & KEY_TRACKING) {
 			if (!tracking) {
@@ -132,6 +201,8 @@ void ui_task( void* pvParameters ) {
 				for (uint32_t ch = 0; ch < NUM_CHANNELS; ch++) {
 					if (ch_state[ch].onoff) tracking_ok = false;
 				}
+				// Nothing to track with a single output
+				if (ps_get_live_mask() != (_BV(NUM_CHANNELS) - 1)) tracking_ok = false;
 				tracking = tracking_ok;
 			} else {
 				tracking = false;
@@ -142,6 +213,7 @@ void ui_task( void* pvParameters ) {
 		uint32_t maxpower = scale[CONVERSION_POWER].max_setpoint;
 
 		for (uint32_t ch = 0; ch < NUM_CHANNELS; ch++) {
+			if (!ps_channel_live(ch)) continue;
 			bool voltincreased = false;
 			bool changed = false;
 			// This needs to be reworked to handle over-voltage/current settings
@@ -172,6 +244,13 @@ void ui_task( void* pvParameters ) {
 				ch_state[ch].volt_setpoint = newvolt;
 				ch_state[ch].curr_setpoint = newcurr;
 
+				if (newkeys & s_ch_cfg[ch].curr_key) {
+					ch_state[ch].disp = ch_state[ch].disp == DISP_ENERGY ? DISP_READBACK : DISP_ENERGY;
+				}
+				if ((newkeys & s_ch_cfg[ch].volt_key) && ch_state[ch].disp == DISP_ENERGY) {
+					energy_reset(ch);
+				}
+
 				if (newkeys & s_ch_cfg[ch].preset_key) {
 					switch (ch_state[ch].disp) {
 					case DISP_PRESET:
@@ -186,24 +265,38 @@ void ui_task( void* pvParameters ) {
 			ps_set_setpoints(ch, ch_state[ch].volt_setpoint, ch_state[ch].curr_setpoint, ch_state[ch].onoff);
 		}
 
-		vTaskDelay(ONE_STEP);
+		uint32_t fresh = ps_wait_readback(PS_LISTENER_UI, ps_get_live_mask(), 0);
 
 		for (uint32_t ch = 0; ch < NUM_CHANNELS; ch++) {
-			uint32_t rbvolt = ps_get_readback(ch, CONVERSION_VOLTAGE);
-			uint32_t rbcurr = ps_get_readback(ch, CONVERSION_CURRENT);
-			uint32_t chstatus = ps_get_status(ch);
+			if (!ps_channel_live(ch)) continue;
+			if (!(events & _BV(UI_EVT_TIMER))) {
+				// Timers only advance once per ONE_STEP
+			} else if (ch_state[ch].disp_timer > 0) {
+				ch_state[ch].disp_timer--;
+			} else if (ch_state[ch].disp != DISP_ENERGY) {
+				ch_state[ch].disp = DISP_READBACK;
+			}
+			ps_snapshot_t snap;
+			ps_get_snapshot(ch, &snap);
+			uint32_t rbvolt = ps_percent_to_display_readback(snap.volt_percent, CONVERSION_VOLTAGE);
+			uint32_t rbcurr = ps_percent_to_display_readback(snap.curr_percent, CONVERSION_CURRENT);
+			uint32_t chstatus = snap.status;
 			memset (dispbuf, 0, sizeof(dispbuf));
 			memset (tmpbuf, 0, sizeof(tmpbuf));
 			if (chstatus != 0xffffffff) {
+				boot_mark(BOOT_FIRST_DISPLAY);
 				// Major hack here as the first response after an on/off toggle we'll get
 				// from the original module firmware will always be old on/off information
-				if (ch_state[ch].onoff == ch_state[ch].lastonoff) {
-					ch_state[ch].onoff = chstatus & 1;
-				} else {
-					ch_state[ch].lastonoff = ch_state[ch].onoff;
+				if (fresh & _BV(ch)) {
+					if (ch_state[ch].onoff == ch_state[ch].lastonoff) {
+						ch_state[ch].onoff = chstatus & 1;
+					} else {
+						ch_state[ch].lastonoff = ch_state[ch].onoff;
+					}
 				}
 
 				uint32_t leftval, rightval, leftmindigits, rightmindigits;
+				uint32_t leftdec = 0, rightdec = 0;
 				switch(ch_state[ch].disp) {
 				case DISP_READBACK:
 					leftval = rbvolt;
@@ -222,6 +315,17 @@ void ui_task( void* pvParameters ) {
 					leftval = chstatus >> 8;
 					rightval = chstatus & 0xff;
 					leftmindigits = rightmindigits = 1;
+					break;
+				case DISP_ENERGY:
+				{
+					energy_info_t energy;
+					energy_get(ch, &energy);
+					leftdec = fit_milli(energy.energy_mwh, &leftval);
+					leftmindigits = leftdec + 1;
+					rightdec = fit_milli(energy.charge_mah, &rightval);
+					rightmindigits = rightdec + 1;
+					break;
+				}
 				default:
 					leftval = rightval = leftmindigits = rightmindigits = 0;
 				}
@@ -243,6 +347,10 @@ void ui_task( void* pvParameters ) {
 					disp_add_glyph(dispbuf, right_dp[ scale[CONVERSION_CURRENT].num_decimals ]);
 					disp_add_glyph(dispbuf, GLYPH_CURRENT);
 					break;
+				case DISP_ENERGY:
+					disp_add_glyph(dispbuf, left_dp[leftdec]);
+					disp_add_glyph(dispbuf, right_dp[rightdec]);
+					break;
 				case DISP_STATUS:
 				default:
 					;
@@ -252,7 +360,11 @@ void ui_task( void* pvParameters ) {
 					if (chstatus & 1) disp_add_glyph(dispbuf, (chstatus & STATUS_MODE_MASK) == STATUS_CC ? GLYPH_CC : GLYPH_CV);
 				}
 				disp_add_glyph(dispbuf, chstatus & STATUS_OUTPUT_ON ? GLYPH_ON : GLYPH_OFF);
-				disp_add_glyph(dispbuf, chstatus & STATUS_OVERTEMP ? GLYPH_OT : GLYPH_MAX);
+				if (chstatus & STATUS_OVERTEMP) {
+					disp_add_glyph(dispbuf, GLYPH_OT);
+				} else if ((chstatus & STATUS_TEMP_WARNING) && (xTaskGetTickCount() & 512)) {
+					disp_add_glyph(dispbuf, GLYPH_OT); // Blink before tripping
+				}
 				if (ch && tracking) {
 					disp_add_glyph(dispbuf, GLYPH_LOCK);
 				}
@@ -261,12 +373,10 @@ void ui_task( void* pvParameters ) {
 				disp_font_str(dispbuf, 0, 8, "--------");
 				ch_state[ch].lastonoff = ch_state[ch].onoff = false;
 			}
-			disp_update(ch ? DISP_CH2 : DISP_CH1, dispbuf, 8, sizeof(dispbuf));
-
-			if (ch_state[ch].disp_timer > 0) {
-				ch_state[ch].disp_timer--;
-			} else {
-				ch_state[ch].disp = DISP_READBACK;
+			// Only talk to the display when something is different
+			if (memcmp(dispbuf, ch_state[ch].shown, sizeof(dispbuf))) {
+				disp_update(ch ? DISP_CH2 : DISP_CH1, dispbuf, 8, sizeof(dispbuf));
+				memcpy(ch_state[ch].shown, dispbuf, sizeof(dispbuf));
 			}
 		}
     }
@@ -2,7 +2,20 @@
 #define UI_H_
 
 #include "chip.h"
+#include <FreeRTOS.h>
 
+// Reasons for ui_task to wake up, the state itself (encoder counts, keys, readback) is
+// fetched from its owner so events may be dropped when the queue is full
+typedef enum {
+	UI_EVT_INPUT = 0, // Encoder step or key press
+	UI_EVT_READBACK, // New readback from a riser
+	UI_EVT_TIMER, // Display timers, every ONE_STEP
+	UI_NUM_EVENTS
+} ui_event_t;
+
+void ui_init(void);
+void ui_post_event(ui_event_t evt);
+void ui_post_event_from_isr(ui_event_t evt, BaseType_t* woken);
 void ui_task( void* pvParameters );
 
 #endif /* UI_H_ */
@@ -4,6 +4,12 @@
 #include <string.h>
 #include "app_usbd_cfg.h"
 #include "cdc_vcom.h"
+#include "gpiomap.h"
+#include "powersupply.h"
+#include "history.h"
+#include "energy.h"
+#include "isputils.h"
+#include "boottime.h"
 
 // NXP USB driver stuff
 static USBD_HANDLE_T g_hUsb;
@@ -58,7 +64,355 @@ USB_INTERFACE_DESCRIPTOR *find_IntfDesc(const uint8_t *pDesc, uint32_t intfClass
 	return pIntfDesc;
 }
 
-// NXP example code for CDC ACM VCOM, to be expanded, right now just echoes input
+// CDC ACM virtual COM port running the command shell below (s_cmds), the USB setup
+// follows the NXP VCOM example
+// Write everything, waiting for the previous packet to be sent if needed (gives up after 10ms)
+static void usb_write(const char* buf, uint32_t len) {
+	while (len) {
+		uint32_t chunk = len > 64 ? 64 : len;
+		TickType_t start = xTaskGetTickCount();
+		while (vcom_write((uint8_t*)buf, chunk) == 0) {
+			if (!vcom_connected() || (xTaskGetTickCount() - start) > 10) return;
+			vTaskDelay(1);
+		}
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+static void usb_puts(const char* str) {
+	usb_write(str, strlen(str));
+}
+
+static void usb_putdec(uint32_t val) {
+	char tmp[10];
+	uint32_t i = sizeof(tmp);
+	do {
+		tmp[--i] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+	usb_write(&tmp[i], sizeof(tmp) - i);
+}
+
+// Parse an unsigned decimal number, returns false if there is none
+static bool parse_dec(const char** str, uint32_t* val) {
+	const char* p = *str;
+	while (*p == ' ') p++;
+	if (*p < '0' || *p > '9') return false;
+	*val = 0;
+	while (*p >= '0' && *p <= '9') {
+		*val = *val * 10 + (*p++ - '0');
+	}
+	*str = p;
+	return true;
+}
+
+// Simple line based command shell on the virtual COM port
+typedef struct {
+	const char* name;
+	void (*handler)(const char* args);
+	const char* help;
+} usb_cmd_t;
+
+static void cmd_help(const char* args);
+
+static void cmd_stats(const char* args) {
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		if (!ps_channel_live(chnum)) continue;
+		const ps_xfer_stats_t* xs = ps_get_xfer_stats(chnum);
+		const ps_tx_stats_t* ts = ps_get_tx_stats(chnum);
+		usb_puts("ch");
+		usb_putdec(chnum);
+		usb_puts(": sent ");
+		usb_putdec(xs->sent);
+		usb_puts(" ok ");
+		usb_putdec(xs->ok);
+		usb_puts(" timeout ");
+		usb_putdec(xs->timeout);
+		usb_puts(" retries ");
+		usb_putdec(xs->retries);
+		usb_puts(" cksum ");
+		usb_putdec(xs->cksum_err);
+		usb_puts(" unexpected ");
+		usb_putdec(xs->unexpected);
+		usb_puts(" txdrop ");
+		usb_putdec(ts->dropped);
+		usb_puts(" txmax ");
+		usb_putdec(ts->max_us);
+		usb_puts("us (blocking send ");
+		usb_putdec(ts->blocking_us);
+		usb_puts("us)\r\n rtt");
+		for (uint32_t i = 0; i < PS_RTT_BUCKETS; i++) {
+			usb_puts(" <");
+			if (i < (PS_RTT_BUCKETS - 1)) {
+				usb_putdec(ps_rtt_bucket_us[i]);
+			} else {
+				usb_puts("inf");
+			}
+			usb_puts(":");
+			usb_putdec(xs->rtt_hist[i]);
+		}
+		usb_puts("\r\n");
+	}
+}
+
+static void cmd_poll(const char* args) {
+	uint32_t ms;
+	if (parse_dec(&args, &ms)) ps_set_poll_interval(ms);
+	usb_puts("poll ");
+	usb_putdec(ps_get_poll_interval());
+	usb_puts("ms\r\n");
+}
+
+static void put_hex(uint32_t val) {
+	char tmp[8];
+	for (uint32_t i = 0; i < 8; i++) {
+		uint32_t nibble = (val >> (28 - i * 4)) & 0xf;
+		tmp[i] = nibble < 10 ? '0' + nibble : 'a' + nibble - 10;
+	}
+	usb_write(tmp, sizeof(tmp));
+}
+
+static void cmd_read(const char* args) {
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		if (!ps_channel_live(chnum)) continue;
+		ps_snapshot_t snap;
+		ps_get_snapshot(chnum, &snap);
+		usb_puts("ch");
+		usb_putdec(chnum);
+		usb_puts(": status ");
+		put_hex(snap.status);
+		usb_puts(" volt ");
+		usb_putdec(ps_percent_to_display_readback(snap.volt_percent, CONVERSION_VOLTAGE));
+		usb_puts(" curr ");
+		usb_putdec(ps_percent_to_display_readback(snap.curr_percent, CONVERSION_CURRENT));
+		usb_puts(" age ");
+		usb_putdec(xTaskGetTickCount() - snap.timestamp);
+		usb_puts("ms\r\n");
+	}
+}
+
+static void put_minmax(const hist_minmax_t* mm, conversions_t type) {
+	usb_puts(" ");
+	usb_putdec(ps_percent_to_display_readback(mm->min, type));
+	usb_puts("/");
+	usb_putdec(ps_percent_to_display_readback(mm->avg, type));
+	usb_puts("/");
+	usb_putdec(ps_percent_to_display_readback(mm->max, type));
+}
+
+// Readback history in display units, newest first
+static void cmd_hist(const char* args) {
+	static const char* const tiernames[HIST_NUM_TIERS] = {"1s", "10s", "1m"};
+	uint32_t chnum;
+	if (!parse_dec(&args, &chnum) || !ps_channel_live(chnum)) {
+		usb_puts("Usage: hist <ch> [raw|1s|10s|1m]\r\n");
+		return;
+	}
+	while (*args == ' ') args++;
+
+	if (!*args || !strcmp(args, "raw")) {
+		hist_raw_t raw;
+		for (uint32_t i = 0; hist_get_raw(chnum, i, &raw); i++) {
+			usb_putdec(ps_percent_to_display_readback(raw.volt, CONVERSION_VOLTAGE));
+			usb_puts(" ");
+			usb_putdec(ps_percent_to_display_readback(raw.curr, CONVERSION_CURRENT));
+			usb_puts("\r\n");
+		}
+		return;
+	}
+	for (uint32_t tier = 0; tier < HIST_NUM_TIERS; tier++) {
+		if (!strcmp(args, tiernames[tier])) {
+			hist_entry_t e;
+			usb_puts("volt min/avg/max curr min/avg/max\r\n");
+			for (uint32_t i = 0; hist_get(chnum, tier, i, &e); i++) {
+				put_minmax(&e.volt, CONVERSION_VOLTAGE);
+				put_minmax(&e.curr, CONVERSION_CURRENT);
+				usb_puts("\r\n");
+			}
+			return;
+		}
+	}
+	usb_puts("Unknown tier\r\n");
+}
+
+static void cmd_energy(const char* args) {
+	uint32_t chnum;
+	if (!parse_dec(&args, &chnum) || !ps_channel_live(chnum)) {
+		usb_puts("Usage: energy <ch> [start|stop|reset]\r\n");
+		return;
+	}
+	while (*args == ' ') args++;
+	if (!strcmp(args, "start")) {
+		energy_start(chnum);
+	} else if (!strcmp(args, "stop")) {
+		energy_stop(chnum);
+	} else if (!strcmp(args, "reset")) {
+		energy_reset(chnum);
+	} else if (*args) {
+		usb_puts("Unknown action\r\n");
+		return;
+	}
+
+	energy_info_t energy;
+	energy_get(chnum, &energy);
+	usb_putdec(energy.charge_mah);
+	usb_puts("mAh ");
+	usb_putdec(energy.energy_mwh);
+	usb_puts("mWh ");
+	usb_putdec(energy.seconds);
+	usb_puts(energy.running ? "s running\r\n" : "s stopped\r\n");
+}
+
+// Stream readback as it arrives, without polling
+static void cmd_watch(const char* args) {
+	uint32_t chnum, count = 20;
+	if (!parse_dec(&args, &chnum) || !ps_channel_live(chnum)) {
+		usb_puts("Usage: watch <ch> [count]\r\n");
+		return;
+	}
+	parse_dec(&args, &count);
+
+	ps_wait_readback(PS_LISTENER_USB, _BV(chnum), 0); // Forget old events
+	while (count--) {
+		if (!ps_wait_readback(PS_LISTENER_USB, _BV(chnum), 200)) {
+			usb_puts("timeout\r\n");
+			return;
+		}
+		ps_snapshot_t snap;
+		ps_get_snapshot(chnum, &snap);
+		usb_putdec(snap.timestamp);
+		usb_puts(" ");
+		usb_putdec(ps_percent_to_display_readback(snap.volt_percent, CONVERSION_VOLTAGE));
+		usb_puts(" ");
+		usb_putdec(ps_percent_to_display_readback(snap.curr_percent, CONVERSION_CURRENT));
+		usb_puts("\r\n");
+	}
+}
+
+static void cmd_isp(const char* args) {
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		const isp_status_t* isp = isp_get_status(chnum);
+		usb_puts("ch");
+		usb_putdec(chnum);
+		usb_puts(": ");
+		usb_puts(isp_state_name(isp->state));
+		if (isp->state == ISP_FAILED) {
+			usb_puts(" at ");
+			usb_puts(isp_state_name(isp->failed_step));
+		}
+		usb_puts(" blocks ");
+		usb_putdec(isp->blocks);
+		usb_puts(" retries ");
+		usb_putdec(isp->retries);
+		usb_puts(" baud ");
+		usb_putdec(isp->baud);
+		usb_puts(" fallbacks ");
+		usb_putdec(isp->fallbacks);
+		usb_puts(" restarts ");
+		usb_putdec(isp->restarts);
+		usb_puts(" load ");
+		usb_putdec(isp->load_ms);
+		usb_puts("ms (verify ");
+		usb_putdec(isp->verify_ms);
+		usb_puts("ms)\r\n");
+	}
+}
+
+static void cmd_boot(const char* args) {
+	for (uint32_t phase = 0; phase < BOOT_NUM_PHASES; phase++) {
+		uint32_t us = boot_get_us(phase);
+		usb_puts(boot_phase_name(phase));
+		usb_puts(": ");
+		if (us == BOOT_NOT_REACHED) {
+			usb_puts("-\r\n");
+			continue;
+		}
+		usb_putdec(us / 1000);
+		usb_puts(".");
+		usb_putdec((us / 100) % 10);
+		usb_puts("ms\r\n");
+	}
+}
+
+// From the linker script, the main stack is what is left of RamLoc16 after .data and .bss
+extern uint8_t _pvHeapStart[];
+extern uint8_t _vStackTop[];
+
+static void cmd_mem(const char* args) {
+	usb_puts("heap ");
+	usb_putdec(configTOTAL_HEAP_SIZE);
+	usb_puts(" free ");
+	usb_putdec(xPortGetFreeHeapSize());
+	usb_puts(" min ");
+	usb_putdec(xPortGetMinimumEverFreeHeapSize());
+	usb_puts("\r\nmain stack ");
+	usb_putdec(_vStackTop - _pvHeapStart);
+	usb_puts("\r\n");
+}
+
+static const usb_cmd_t s_cmds[] = {
+	{"help", cmd_help, "List commands"},
+	{"stats", cmd_stats, "Riser link statistics"},
+	{"isp", cmd_isp, "Riser firmware load result per channel"},
+	{"boot", cmd_boot, "Time from reset to each boot phase"},
+	{"mem", cmd_mem, "FreeRTOS heap and main stack size"},
+	{"poll", cmd_poll, "[ms] Readback poll/keepalive interval"},
+	{"read", cmd_read, "Status and readback (display units)"},
+	{"watch", cmd_watch, "<ch> [count] Stream readback as it arrives"},
+	{"energy", cmd_energy, "<ch> [start|stop|reset] Charge and energy totals"},
+	{"hist", cmd_hist, "<ch> [raw|1s|10s|1m] Readback history, newest first"},
+};
+
+static void cmd_help(const char* args) {
+	for (uint32_t i = 0; i < sizeof(s_cmds) / sizeof(s_cmds[0]); i++) {
+		usb_puts(s_cmds[i].name);
+		usb_puts(" - ");
+		usb_puts(s_cmds[i].help);
+		usb_puts("\r\n");
+	}
+}
+
+static void usb_exec(char* line) {
+	char* args = line;
+	while (*args && *args != ' ') args++;
+	if (*args) *args++ = '\0';
+	if (!*line) return;
+
+	for (uint32_t i = 0; i < sizeof(s_cmds) / sizeof(s_cmds[0]); i++) {
+		if (!strcmp(line, s_cmds[i].name)) {
+			s_cmds[i].handler(args);
+			return;
+		}
+	}
+	usb_puts("Unknown command, try help\r\n");
+}
+
+#define LINE_SIZE (64)
+static char s_line[LINE_SIZE];
+static uint32_t s_linelen = 0;
+
+static void usb_rx(const uint8_t* buf, uint32_t len) {
+	for (uint32_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (c == '\r' || c == '\n') {
+			if (s_linelen) {
+				usb_puts("\r\n");
+				s_line[s_linelen] = '\0';
+				usb_exec(s_line);
+				s_linelen = 0;
+			}
+			usb_puts("> ");
+		} else if ((c == '\b' || c == 0x7f) && s_linelen) {
+			s_linelen--;
+			usb_puts("\b \b");
+		} else if (c >= ' ' && s_linelen < (LINE_SIZE - 1)) {
+			s_line[s_linelen++] = c;
+			usb_write(&c, 1); // Echo
+		}
+	}
+}
+
 void usb_task( void* pvParameters ) {
 	USBD_API_INIT_PARAM_T usb_param;
 	USB_CORE_DESCS_T desc;
@@ -105,14 +459,14 @@ void usb_task( void* pvParameters ) {
 	while (1) {
 		/* Check if host has connected and opened the VCOM port */
 		if ((vcom_connected() != 0) && (prompt == 0)) {
-			vcom_write("Hello World!!\r\n", 15);
+			usb_puts("ps2k-front\r\n> ");
 			prompt = 1;
 		}
-		/* If VCOM port is opened echo whatever we receive back to host. */
+		/* If VCOM port is opened pass whatever we receive to the command shell */
 		if (prompt) {
 			rdCnt = vcom_bread(&g_rxBuff[0], 64);
 			if (rdCnt) {
-				vcom_write(&g_rxBuff[0], rdCnt);
+				usb_rx(&g_rxBuff[0], rdCnt);
 			}
 		}
 		/* Sleep until next IRQ happens */
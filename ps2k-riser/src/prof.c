@@ -0,0 +1,80 @@
+/*
+ * prof.c - ISR cycle count profiling using the DWT cycle counter
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chip.h"
+#include "prof.h"
+#include <string.h>
+
+#if ENABLE_PROFILING
+
+prof_stats_t prof_stats[PROF_MAX_VAL];
+uint32_t prof_turnaround_last = 0;
+uint32_t prof_turnaround_max = 0;
+
+void prof_init(void) {
+	// init_swo() overwrites DWT->CTRL so this has to be called after it
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	prof_reset();
+}
+
+void prof_reset(void) {
+	__disable_irq();
+	memset(prof_stats, 0, sizeof(prof_stats));
+	prof_turnaround_last = 0;
+	prof_turnaround_max = 0;
+	__enable_irq();
+}
+
+static uint32_t put_be32(uint8_t* buf, uint32_t val) {
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val & 0xff;
+	return 4;
+}
+
+static uint32_t put_be16_sat(uint8_t* buf, uint32_t val) {
+	if (val > 0xffff) val = 0xffff;
+	buf[0] = val >> 8;
+	buf[1] = val & 0xff;
+	return 2;
+}
+
+// Objects have to fit in a 15 byte frame (type+len, obj id, payload, checksum) so 12 bytes max
+// ISR objects: count (32-bit), min (16-bit, saturated), avg (16-bit, saturated), max (32-bit)
+// Turnaround object (idx == PROF_MAX_VAL): last and worst cycles from request to response (32-bit each)
+uint32_t prof_get_obj(uint32_t idx, uint8_t* buf) {
+	uint32_t len = 0;
+	if (idx < PROF_MAX_VAL) {
+		prof_stats_t tmp;
+		__disable_irq();
+		tmp = prof_stats[idx]; // Consistent copy as the stats are updated from higher prio ISRs
+		__enable_irq();
+		len += put_be32(&buf[len], tmp.count);
+		len += put_be16_sat(&buf[len], tmp.min);
+		len += put_be16_sat(&buf[len], tmp.avg_q4 >> 4);
+		len += put_be32(&buf[len], tmp.max);
+	} else if (idx == PROF_MAX_VAL) {
+		len += put_be32(&buf[len], prof_turnaround_last);
+		len += put_be32(&buf[len], prof_turnaround_max);
+	}
+	return len;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef PROF_H_
+#define PROF_H_
+
+// Set to 0 to compile out all ISR cycle counting (the macros below then expand to nothing)
+#ifndef ENABLE_PROFILING
+#define ENABLE_PROFILING (1)
+#endif
+
+typedef enum {
+	PROF_UART_ISR = 0,
+	PROF_ADC_ISR,
+	PROF_MAX_VAL
+} prof_t;
+
+#if ENABLE_PROFILING
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t avg_q4; // Running average (1/16 weight per sample) with 4 fractional bits
+} prof_stats_t;
+
+extern prof_stats_t prof_stats[PROF_MAX_VAL];
+extern uint32_t prof_turnaround_last;
+extern uint32_t prof_turnaround_max;
+
+// Cycle counts are from DWT->CYCCNT (core clock), which wraps every ~60s at 72MHz,
+// plain unsigned subtraction handles the wrap as long as a single ISR is shorter than that
+static inline void prof_update(prof_t id, uint32_t cycles) {
+	prof_stats_t* p = &prof_stats[id];
+	if (!p->count) {
+		p->min = p->max = cycles;
+		p->avg_q4 = cycles << 4;
+	} else {
+		if (cycles < p->min) p->min = cycles;
+		if (cycles > p->max) p->max = cycles;
+		p->avg_q4 += cycles - (p->avg_q4 >> 4);
+	}
+	p->count++;
+}
+
+static inline void prof_turnaround(uint32_t cycles) {
+	prof_turnaround_last = cycles;
+	if (cycles > prof_turnaround_max) prof_turnaround_max = cycles;
+}
+
+#define PROF_NOW() (DWT->CYCCNT)
+#define PROF_ENTER() uint32_t prof_enter_cyc = PROF_NOW()
+#define PROF_EXIT(id) prof_update((id), PROF_NOW() - prof_enter_cyc)
+
+void prof_init(void);
+uint32_t prof_get_obj(uint32_t idx, uint8_t* buf);
+void prof_reset(void);
+
+#else
+
+#define PROF_ENTER()
+#define PROF_EXIT(id)
+
+#endif
+
+#endif /* PROF_H_ */
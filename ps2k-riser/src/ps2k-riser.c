@@ -26,6 +26,8 @@
 #include "chip.h"
 #include "debug.h"
 #include "ee.h"
+#include "prof.h"
+#include "trace.h"
 #include <string.h>
 
 static LPC_TIMER_T* timers[] = { LPC_TIMER16_0, LPC_TIMER16_1, LPC_TIMER32_1 };
@@ -37,10 +39,42 @@ static LPC_TIMER_T* timers[] = { LPC_TIMER16_0, LPC_TIMER16_1, LPC_TIMER32_1 };
 #define STATUS_CC _BV(2)
 #define STATUS_OUTPUT_ON _BV(0)
 
+// Trip reasons reported in the second status byte (sticky until the output is turned on again)
+#define TRIP_LINK_TIMEOUT _BV(0)
+#define TRIP_WATCHDOG _BV(1)
+#define TEMP_WARNING _BV(2) // Live flag in the second status byte, temperature is in the warning band
+
+// Objects not used by the original firmware/front panel
+#define OBJ_PROF_BASE (0x40) // 0x40 UART ISR, 0x41 ADC ISR, 0x42 response turnaround (any set resets all)
+#define OBJ_TRIP (0x48) // Trip reason byte, any set clears it
+#define OBJ_LINK_TIMEOUT (0x49) // Link timeout in ms (16-bit), 0 disables
+#define OBJ_IMAGE_ID (0x4a) // Image id (32-bit), read-only
+#define OBJ_TEMP (0x50) // Temperature in 1/256 degC (signed 16-bit) followed by the calibrated reading (16-bit)
+#define OBJ_TEMP_THRES (0x51) // Warning, trip and release temperatures in 1/256 degC (signed 16-bit each)
+#define OBJ_TEMP_CONV (0x52) // Reading at reference point, reference temperature, degC per reading (Q16), set flag
+
 static void output_enable(bool on) {
 	LPC_GPIO_PORT->B[0][17] = !on;
 }
 
+static bool output_enabled(void) {
+	return !LPC_GPIO_PORT->B[0][17];
+}
+
+// Output is turned off if no setpoint frame has been received for this long while it's on
+#define LINK_TIMEOUT_DEFAULT_MS (100)
+static uint16_t s_link_timeout_ms = LINK_TIMEOUT_DEFAULT_MS;
+static volatile uint32_t s_ticks = 0; // 1ms SysTick counter
+static uint32_t s_last_frame_tick = 0;
+static bool s_link_latched = false; // Output forced off until the front panel requests off
+static uint8_t s_trip = 0;
+
+// Watchdog is only fed when both the ADC and UART have made progress during the last check period
+#define WDT_TIMEOUT_MS (250)
+#define WDT_CHECK_MS (50)
+static volatile uint32_t s_adc_results = 0;
+static volatile uint32_t s_uart_frames = 0;
+
 // RAM copies of EEPROM data
 static ee_id s_id;
 static ee_cal s_cal;
@@ -70,9 +104,33 @@ static const uint8_t s_adscan[] = {AD_REF, AD_CURR, AD_VOLT, AD_LOOP, AD_TEMP};
 // ADC input below ~1.428V triggers OT with oem firmware, this is the scaled value I
 // measured at the same input.
 #define OVERTEMP_THRES (14928)
-static uint16_t s_adc_temp_compare = 0;
+
+// The temperature sensor hasn't been characterised, so until OBJ_TEMP_CONV is set from real
+// measurements the "degC" values are UNCALIBRATED. Only the oem trip point is known, the
+// default conversion calls it 80 and counts 0.01 per reading step from there (the
+// calibrated reading decreases as the temperature goes up). The gain is made up, so the
+// default trip is exactly the oem one while warning and release are just 1000 and 500
+// reading steps before it, not 10 and 5 degrees. OBJ_TEMP_CONV reports whether it was set.
+#define DEGC(x) ((int32_t)((x) * 256))
+static uint16_t s_temp_ref_reading = OVERTEMP_THRES;
+static int16_t s_temp_ref = DEGC(80);
+static uint16_t s_temp_gain = 655; // degC per reading step in Q16, a guess
+static bool s_temp_conv_set = false;
+
+static int16_t s_temp_warn = DEGC(70);
+static int16_t s_temp_trip = DEGC(80);
+static int16_t s_temp_release = DEGC(75);
+
+static uint16_t s_temp_reading = 0; // Calibrated (CAL_TEMP_READ) reading
+static int16_t s_temp = 0; // 1/256 degC, uncalibrated unless s_temp_conv_set
+static bool s_temp_warning = false;
 static bool s_overtemp = false;
 
+// The second word is patched with a hash of the whole image by tools/lzpack.py, the front
+// panel compares it to the image it carries and skips ISP loading if it matches
+#define IMAGE_ID_MAGIC (0x44493250)
+__attribute__((used)) static const volatile uint32_t s_image_id[2] = {IMAGE_ID_MAGIC, 0};
+
 static uint32_t calc_checksum(uint8_t* buf, uint32_t size) {
 	uint32_t result = 0;
 	for (int i = 0; i < size; i++) {
@@ -139,13 +197,68 @@ static uint32_t convert_adc_readback(cal_t id, uint32_t value) {
 	return tmp;
 }
 
+static int16_t temp_from_reading(uint32_t reading) {
+	int32_t tmp = (int32_t)s_temp_ref_reading - (int32_t)reading;
+	tmp *= s_temp_gain;
+	tmp >>= 8; // Q16 to 1/256 degC
+	tmp += s_temp_ref;
+	if (tmp > INT16_MAX) tmp = INT16_MAX;
+	if (tmp < INT16_MIN) tmp = INT16_MIN;
+	return tmp;
+}
+
+static void update_temp(uint32_t adc) {
+	s_temp_reading = convert_adc_readback(CAL_TEMP_READ, adc);
+	s_temp = temp_from_reading(s_temp_reading);
+	s_temp_warning = s_temp >= s_temp_warn;
+
+	// Trip and release at different temperatures to avoid chatter around the threshold
+	if (!s_overtemp && s_temp >= s_temp_trip) {
+		trace_event(TRACE_OVERTEMP, 1);
+		s_overtemp = true;
+	} else if (s_overtemp && s_temp <= s_temp_release) {
+		trace_event(TRACE_OVERTEMP, 0);
+		s_overtemp = false;
+	}
+	if (s_overtemp) output_enable(false);
+}
+
+// CC/CV detection thresholds in 1/256% steps. CC is entered when the current readback
+// reaches the current setpoint, or is close to it while the voltage sags below its
+// setpoint, and left when the current is clearly below its setpoint. A voltage below its
+// setpoint alone is no CC, the output may just be ramping up. Neither is a current
+// setpoint close to zero with no load, so CC needs a minimum current setpoint.
+#define CC_CURR_ENTER (64) // 0.25%
+#define CC_CURR_EXIT (192) // 0.75%
+#define CC_VOLT_ENTER (64)
+#define CC_MIN_CURR (256) // 1%, above CC_CURR_EXIT so no load always reads as CV
+static bool s_cc = false;
+
+static void update_mode(void) {
+	if (s_overtemp || !output_enabled()) {
+		s_cc = false;
+		return;
+	}
+	int32_t curr_below = (int32_t)s_setpoint.current - readback_curr;
+	int32_t volt_below = (int32_t)s_setpoint.voltage - readback_volt;
+	bool at_limit = s_setpoint.current >= CC_MIN_CURR && curr_below <= CC_CURR_EXIT;
+	if (!s_cc) {
+		if (at_limit && (curr_below <= CC_CURR_ENTER || volt_below >= CC_VOLT_ENTER)) s_cc = true;
+	} else {
+		if (!at_limit) s_cc = false;
+	}
+}
+
 static void handle_set_setpoint(uint32_t len) {
 
 	uint8_t newonoff = s_rxbuf[1];
 	uint16_t newvolt = s_rxbuf[2] << 8 | s_rxbuf[3];
 	uint16_t newcurr = s_rxbuf[4] << 8 | s_rxbuf[5];
 
-	if (s_overtemp) newonoff = 0;
+	s_last_frame_tick = s_ticks;
+	if (!(newonoff & 1)) s_link_latched = false;
+	if (s_overtemp || s_link_latched) newonoff = 0;
+	if ((newonoff & 1) && !output_enabled()) s_trip = 0; // Output (re-)enabled, forget why it tripped
 	// Sanity check against max power
 	uint32_t power = (newvolt * newcurr) >> 16;
 	if (power < s_id.max_out_power) {
@@ -161,31 +274,22 @@ static void handle_set_setpoint(uint32_t len) {
 		}
 		output_enable (newonoff & 1);
 	} else {
-		ITM_SendChar('R');
+		trace_event(TRACE_SETPOINT_REJECTED, power);
 	}
 
-	readback_volt = convert_adc_readback(CAL_VOLT_READ, s_adc_result[AD_VOLT]);
-	readback_curr = convert_adc_readback(CAL_CURR_READ, s_adc_result[AD_CURR]);
-
-	bool cc = false;
-	if (!s_overtemp && newonoff) {
-		// Figure out how much lower the actual readback is from setpoint
-		// If more than 0.25% lower (64 steps) we're in CC mode
-		int32_t tmp = s_setpoint.voltage;
-		tmp -= readback_volt;
-		if (tmp >= 64) cc = true;
-	}
+	// Readback and mode are kept up to date by the ADC interrupt, only the on/off state may have changed
+	update_mode();
 
 	uint8_t resp[8];
 	resp[0] = 0x17;
 	resp[1] = (s_overtemp ? STATUS_OVERTEMP : 0) |
-			(cc ? STATUS_CC : 0) |
+			(s_cc ? STATUS_CC : 0) |
 			(newonoff ? STATUS_OUTPUT_ON : 0); // ps on/off, cc operation and overtemp
 	resp[2] = readback_volt >> 8;
 	resp[3] = readback_volt & 0xff;
 	resp[4] = readback_curr >> 8;
 	resp[5] = readback_curr & 0xff;
-	resp[6] = 0x00; // ?
+	resp[6] = s_trip | (s_temp_warning ? TEMP_WARNING : 0); // Second status byte
 	resp[7] = (uint8_t)calc_checksum(resp, 7);
 	for (uint32_t i = 0; i < 8; i++) {
 		LPC_USART->THR = resp[i];
@@ -215,9 +319,92 @@ static void handle_set_get_obj(uint32_t len) {
 			resp[rlen++] = s_setpoint.current >> 8;
 			resp[rlen++] = s_setpoint.current & 0xff;
 			break;
+#if ENABLE_PROFILING
+		case OBJ_PROF_BASE + PROF_UART_ISR:
+		case OBJ_PROF_BASE + PROF_ADC_ISR:
+		case OBJ_PROF_BASE + PROF_MAX_VAL:
+			rlen += prof_get_obj(obj - OBJ_PROF_BASE, &resp[rlen]);
+			break;
+#endif
+		case OBJ_TRIP:
+			resp[rlen++] = s_trip;
+			break;
+		case OBJ_LINK_TIMEOUT:
+			resp[rlen++] = s_link_timeout_ms >> 8;
+			resp[rlen++] = s_link_timeout_ms & 0xff;
+			break;
+		case OBJ_IMAGE_ID: {
+			uint32_t id = s_image_id[1];
+			resp[rlen++] = id >> 24;
+			resp[rlen++] = (id >> 16) & 0xff;
+			resp[rlen++] = (id >> 8) & 0xff;
+			resp[rlen++] = id & 0xff;
+			break;
+		}
+		case OBJ_TEMP:
+			resp[rlen++] = (uint16_t)s_temp >> 8;
+			resp[rlen++] = s_temp & 0xff;
+			resp[rlen++] = s_temp_reading >> 8;
+			resp[rlen++] = s_temp_reading & 0xff;
+			break;
+		case OBJ_TEMP_THRES:
+			resp[rlen++] = (uint16_t)s_temp_warn >> 8;
+			resp[rlen++] = s_temp_warn & 0xff;
+			resp[rlen++] = (uint16_t)s_temp_trip >> 8;
+			resp[rlen++] = s_temp_trip & 0xff;
+			resp[rlen++] = (uint16_t)s_temp_release >> 8;
+			resp[rlen++] = s_temp_release & 0xff;
+			break;
+		case OBJ_TEMP_CONV:
+			resp[rlen++] = s_temp_ref_reading >> 8;
+			resp[rlen++] = s_temp_ref_reading & 0xff;
+			resp[rlen++] = (uint16_t)s_temp_ref >> 8;
+			resp[rlen++] = s_temp_ref & 0xff;
+			resp[rlen++] = s_temp_gain >> 8;
+			resp[rlen++] = s_temp_gain & 0xff;
+			resp[rlen++] = s_temp_conv_set; // 0 while still the uncalibrated defaults
+			break;
 		}
 	} else { // Set
-		// Not implemented yet
+		switch (obj) {
+#if ENABLE_PROFILING
+		case OBJ_PROF_BASE + PROF_UART_ISR:
+		case OBJ_PROF_BASE + PROF_ADC_ISR:
+		case OBJ_PROF_BASE + PROF_MAX_VAL:
+			prof_reset();
+			break;
+#endif
+		case OBJ_TRIP:
+			s_trip = 0;
+			break;
+		case OBJ_LINK_TIMEOUT:
+			if (len == 4) s_link_timeout_ms = s_rxbuf[2] << 8 | s_rxbuf[3];
+			break;
+		case OBJ_TEMP_THRES:
+			if (len == 8) {
+				int16_t warn = s_rxbuf[2] << 8 | s_rxbuf[3];
+				int16_t trip = s_rxbuf[4] << 8 | s_rxbuf[5];
+				int16_t release = s_rxbuf[6] << 8 | s_rxbuf[7];
+				// Release has to be below trip or there's no hysteresis at all, and a warning
+				// above the trip would never be seen
+				if (release < trip && warn <= trip) {
+					s_temp_warn = warn;
+					s_temp_trip = trip;
+					s_temp_release = release;
+				}
+			}
+			break;
+		case OBJ_TEMP_CONV:
+			if (len == 8) {
+				s_temp_ref_reading = s_rxbuf[2] << 8 | s_rxbuf[3];
+				s_temp_ref = s_rxbuf[4] << 8 | s_rxbuf[5];
+				s_temp_gain = s_rxbuf[6] << 8 | s_rxbuf[7];
+				s_temp_conv_set = true;
+			}
+			break;
+		default:
+			; // Not implemented yet
+		}
 	}
 	resp[0] = 0x80 | rlen;
 	resp[rlen] = (uint8_t)calc_checksum(resp, rlen);
@@ -240,28 +427,50 @@ static void parse_rxbuf(void) {
 	}
 }
 
+#if ENABLE_PROFILING
+static uint32_t s_frame_start = 0;
+#endif
+
 void UART_IRQHandler(void) {
+	PROF_ENTER();
 	uint32_t iir = LPC_USART->IIR;
 
+#if ENABLE_PROFILING
+	// Turnaround is measured from the interrupt that received the first byte(s) of a request
+	// (normally the char timeout one as requests are shorter than the rx fifo trigger level)
+	if (!s_numrx) s_frame_start = prof_enter_cyc;
+#endif
+
 	while(LPC_USART->LSR & UART_LSR_RDR) {
 		uint32_t tmp = LPC_USART->RBR; // Read rx data
 		if (s_numrx < (RX_SIZE - 1)) {
 			s_rxbuf[s_numrx++] = (uint8_t)tmp;
 		}
-	}
 
-	// Minimum packet type+len byte, payload byte and checksum byte
-	if (s_numrx > 2 && (s_numrx - 1) == (s_rxbuf[0] & 0xf) &&
-			s_rxbuf[s_numrx - 1] == (uint8_t)calc_checksum(s_rxbuf, s_numrx - 1)) {
-		ITM_SendChar('G');
-		parse_rxbuf();
-		s_numrx = 0;
+		// Check for a complete frame after every byte as the front may pipeline requests.
+		// Minimum packet type+len byte, payload byte and checksum byte
+		if (s_numrx > 2 && (s_numrx - 1) == (s_rxbuf[0] & 0xf)) {
+			if (s_rxbuf[s_numrx - 1] == (uint8_t)calc_checksum(s_rxbuf, s_numrx - 1)) {
+				trace_event(TRACE_RX_FRAME, s_rxbuf[0]);
+				s_uart_frames++;
+				parse_rxbuf();
+#if ENABLE_PROFILING
+				prof_turnaround(PROF_NOW() - s_frame_start);
+#endif
+			}
+			s_numrx = 0;
+#if ENABLE_PROFILING
+			s_frame_start = PROF_NOW();
+#endif
+		}
 	}
+
 	if (s_numrx && (iir & UART_IIR_INTID_MASK) == UART_IIR_INTID_CTI) {
 		// timeout, restart next transmission from the beginning no matter what
-		ITM_SendChar('0' + s_numrx);
+		trace_event(TRACE_RX_TIMEOUT, s_numrx);
 		s_numrx = 0;
 	}
+	PROF_EXIT(PROF_UART_ISR);
 }
 
 static uint32_t s_adc_cr = 0;
@@ -284,6 +493,7 @@ static void adc_setup_burst(uint32_t ch) {
 }
 
 void ADC_IRQHandler(void) {
+	PROF_ENTER();
 //	ITM_SendChar('A');
 	uint32_t reqch = (s_adc_state >> 16) & 0x7;
 	uint32_t data = LPC_ADC->DR[reqch];
@@ -304,18 +514,68 @@ void ADC_IRQHandler(void) {
 			tmp += 1 << 8; // Round
 			tmp >>= 9; // 4 bits oversampling with 8192 samples requires accumulator to be /512
 			s_adc_result[reqch] = tmp;
-			if (reqch == AD_TEMP) {
+			s_adc_results++;
+			trace_event(TRACE_ADC_RESULT, reqch << 16 | tmp);
+			switch (reqch) {
+			case AD_VOLT:
+				readback_volt = convert_adc_readback(CAL_VOLT_READ, tmp);
+				update_mode();
+				break;
+			case AD_CURR:
+				readback_curr = convert_adc_readback(CAL_CURR_READ, tmp);
+				update_mode();
+				break;
+			case AD_TEMP:
 //				printhex_itm("ad:  ", reqch << 28 | tmp);
-//				printhex_itm("comp:", s_adc_temp_compare);
-				if (tmp < s_adc_temp_compare) {
-					s_overtemp = true;
-					output_enable(false);
-				} else {
-					s_overtemp = false;
-				}
+				update_temp(tmp);
+				break;
 			}
 		}
 	}
+	PROF_EXIT(PROF_ADC_ISR);
+}
+
+void SysTick_Handler(void) {
+	uint32_t ticks = ++s_ticks;
+	if (s_link_timeout_ms && output_enabled() && (ticks - s_last_frame_tick) >= s_link_timeout_ms) {
+		output_enable(false);
+		s_link_latched = true;
+		s_trip |= TRIP_LINK_TIMEOUT;
+		trace_event(TRACE_LINK_TIMEOUT, ticks - s_last_frame_tick);
+	}
+}
+
+static void wdt_init(void) {
+	Chip_WWDT_Init(LPC_WWDT);
+	Chip_WWDT_SelClockSource(LPC_WWDT, WWDT_CLKSRC_IRC);
+	// The watchdog counts the selected 12MHz clock divided by 4
+	Chip_WWDT_SetTimeOut(LPC_WWDT, (12000000 / 4 / 1000) * WDT_TIMEOUT_MS);
+	Chip_WWDT_SetOption(LPC_WWDT, WWDT_WDMOD_WDRESET);
+	Chip_WWDT_Start(LPC_WWDT);
+}
+
+static void wdt_service(void) {
+	static uint32_t lasttick = 0;
+	static uint32_t lastadc = 0;
+	static uint32_t lastuart = 0;
+
+	uint32_t now = s_ticks;
+	if ((now - lasttick) < WDT_CHECK_MS) return;
+
+	// ADC results arrive every ~18ms so there must be new ones. The UART is considered stuck
+	// if there's unread data in the rx fifo but no frames have been handled
+	bool adc_ok = s_adc_results != lastadc;
+	bool uart_ok = s_uart_frames != lastuart || !(LPC_USART->LSR & UART_LSR_RDR);
+	lasttick = now;
+	lastadc = s_adc_results;
+	lastuart = s_uart_frames;
+
+	if (adc_ok && uart_ok) {
+		// No other bus accesses are allowed in the middle of the feed sequence
+		__disable_irq();
+		Chip_WWDT_Feed(LPC_WWDT);
+		__enable_irq();
+	}
 }
 
 int main(void) {
@@ -331,6 +591,11 @@ int main(void) {
 	LPC_GPIO_PORT->DIR[0] = 1 << 17;
 	output_enable(false);
 
+	// A watchdog reset brings up whatever is in the riser flash. Once this firmware is loaded
+	// again report the reset as the trip reason
+	if (Chip_SYSCTL_GetSystemRSTStatus() & SYSCTL_RST_WDT) s_trip |= TRIP_WATCHDOG;
+	Chip_SYSCTL_ClearSystemRSTStatus(SYSCTL_RST_WDT);
+
 	// ADC pinmux
 	LPC_IOCON->PIO0[11] = IOCON_FUNC2 | IOCON_MODE_INACT | IOCON_ADMODE_EN; // ad0 reference
 	LPC_IOCON->PIO0[12] = IOCON_FUNC2 | IOCON_MODE_INACT | IOCON_ADMODE_EN; // ad1 current
@@ -348,6 +613,10 @@ int main(void) {
 	LPC_IOCON->PIO0[9] = IOCON_FUNC3 | IOCON_MODE_PULLUP | IOCON_RESERVED_BIT_7; // SWO output
 
 	init_swo();
+	trace_init();
+#if ENABLE_PROFILING
+	prof_init();
+#endif
 
 	// PWM outputs
 	LPC_IOCON->PIO0[8] = IOCON_FUNC2 | IOCON_MODE_INACT | IOCON_RESERVED_BIT_7; // CT16B0_MAT0 loops to ad ch6?
@@ -383,9 +652,6 @@ int main(void) {
 	Chip_UART_ConfigData(LPC_USART, (UART_LCR_WLEN8 | UART_LCR_SBS_1BIT));
 	Chip_UART_SetupFIFOS(LPC_USART, (UART_FCR_FIFO_EN | UART_FCR_TRG_LEV3));
 
-	// Pre-calculate over-temperature threshold (ad reading below this triggers alarm and output disable)
-	s_adc_temp_compare = ((1 << ADCSHIFT) * (OVERTEMP_THRES - s_cal.cal[CAL_TEMP_READ].offset)) / s_cal.cal[CAL_TEMP_READ].gain;
-
 	ADC_CLOCK_SETUP_T adc;
 	Chip_ADC_Init(LPC_ADC, &adc);
 	s_adc_cr = LPC_ADC->CR &= ~ADC_CR_LPWRMODE;
@@ -424,10 +690,17 @@ int main(void) {
 	NVIC_EnableIRQ(ADC_IRQn);
 	adc_setup_burst(0);
 
+	// 1ms tick for link supervision, same priority as the other interrupts so it never preempts them
+	SysTick_Config(SystemCoreClock / 1000);
+	NVIC_SetPriority(SysTick_IRQn, 0);
+	wdt_init();
+
     volatile static int i = 0 ;
     // Enter an infinite loop, just incrementing a counter
     while(1) {
     	__WFI();
+    	wdt_service();
+    	trace_drain();
     	if (!(i & 0xfffff)) ITM_SendChar('.');
         i++ ;
 //        __asm volatile ("nop");
@@ -0,0 +1,92 @@
+/*
+ * trace.c - Buffered binary event trace over SWO
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ISRs push events (cycle counter timestamp, 8-bit id and 24-bit payload) into a RAM ring
+// and the main loop drains it to ITM. Each event becomes two 32-bit ITM writes, the
+// timestamp on TRACE_PORT_TIMESTAMP followed by id << 24 | payload on TRACE_PORT_EVENT.
+// With the TPIU in NRZ mode that is 10 bytes on the wire per event (~1150 events/s at 115k2).
+
+#include "chip.h"
+#include "trace.h"
+
+#if ENABLE_TRACE
+
+typedef struct {
+	uint32_t timestamp;
+	uint32_t event;
+} trace_entry_t;
+
+#define TRACE_SIZE (32) // Must be a power of two
+static trace_entry_t s_trace[TRACE_SIZE];
+
+// Single producer (the ISRs all run at the same priority so they never preempt each other)
+// and single consumer (main loop), so head and tail only need to be written by one side each
+static volatile uint32_t s_head = 0;
+static volatile uint32_t s_tail = 0;
+static uint32_t s_dropped = 0;
+static bool s_ts_sent = false; // Timestamp of the entry at s_tail already written
+
+void trace_init(void) {
+	// init_swo() has to be called first
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	ITM->TER |= (1 << TRACE_PORT_TIMESTAMP) | (1 << TRACE_PORT_EVENT);
+}
+
+static void trace_push(uint32_t head, trace_id_t id, uint32_t payload) {
+	trace_entry_t* e = &s_trace[head & (TRACE_SIZE - 1)];
+	e->timestamp = DWT->CYCCNT;
+	e->event = id << 24 | (payload & 0xffffff);
+}
+
+void trace_event(trace_id_t id, uint32_t payload) {
+	uint32_t head = s_head;
+	uint32_t free = TRACE_SIZE - (head - s_tail);
+	if (s_dropped) {
+		// Report lost events first, but only when there's room for the new event as well
+		if (free < 2) {
+			s_dropped++;
+			return;
+		}
+		trace_push(head++, TRACE_DROPPED, s_dropped);
+		s_dropped = 0;
+		free--;
+	}
+	if (!free) {
+		s_dropped++;
+		return;
+	}
+	trace_push(head++, id, payload);
+	s_head = head;
+}
+
+void trace_drain(void) {
+	while (s_tail != s_head) {
+		trace_entry_t* e = &s_trace[s_tail & (TRACE_SIZE - 1)];
+		if (!s_ts_sent) {
+			if (ITM->PORT[TRACE_PORT_TIMESTAMP].u32 == 0) return; // FIFO full, try again later
+			ITM->PORT[TRACE_PORT_TIMESTAMP].u32 = e->timestamp;
+			s_ts_sent = true;
+		}
+		if (ITM->PORT[TRACE_PORT_EVENT].u32 == 0) return;
+		ITM->PORT[TRACE_PORT_EVENT].u32 = e->event;
+		s_ts_sent = false;
+		s_tail++;
+	}
+}
+
+#endif
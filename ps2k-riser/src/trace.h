@@ -0,0 +1,39 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// Set to 0 to compile out the binary SWO event trace
+#ifndef ENABLE_TRACE
+#define ENABLE_TRACE (1)
+#endif
+
+// ITM stimulus ports used, port 0 is still the text debug output (ITM_SendChar)
+#define TRACE_PORT_TIMESTAMP (1)
+#define TRACE_PORT_EVENT (2)
+
+// Keep in sync with tools/swotrace.py
+typedef enum {
+	TRACE_DROPPED = 0, // payload: number of events lost due to a full buffer
+	TRACE_RX_FRAME, // payload: type+len byte of a valid request
+	TRACE_RX_TIMEOUT, // payload: number of bytes discarded on char timeout
+	TRACE_SETPOINT_REJECTED, // payload: requested power (V * I >> 16)
+	TRACE_ADC_RESULT, // payload: ad channel << 16 | result
+	TRACE_OVERTEMP, // payload: 1 on trip, 0 on release
+	TRACE_LINK_TIMEOUT, // payload: ms since last setpoint frame
+	TRACE_MAX_VAL
+} trace_id_t;
+
+#if ENABLE_TRACE
+
+void trace_init(void);
+void trace_event(trace_id_t id, uint32_t payload); // Safe to call from ISRs, never blocks
+void trace_drain(void); // Call from main loop, only writes to ITM when the fifo has room
+
+#else
+
+#define trace_init()
+#define trace_event(id, payload)
+#define trace_drain()
+
+#endif
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,319 @@
+#!/usr/bin/env python3
+#
+# ispemu.py - Emulate the LPC1315 ISP bootloader of a ps2k riser on a pty
+#
+# Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Lets the riser loading be tested and timed without hardware. The emulator prints the
+# pty to use, point a host build of the loader (or lpc21isp, or a plain terminal) at it:
+#   tools/ispemu.py --baud 230400 --drop 0.001 --resend 2
+#
+# Implemented: ? sync, Synchronized, the crystal frequency, echo (on at start, A 0/1),
+# U 23130, W to RAM (uuencoded rows, checksum after every 20 rows, OK/RESEND), R (same
+# format the other way around, the host answers OK/RESEND) and G.
+# Anything else gets INVALID_COMMAND. A session ends with G, a timeline is printed then.
+#
+# A pty has no baud rate, the emulator instead paces its own output and reports the time
+# the data would have taken on the wire at --baud next to the real elapsed time. Nor does
+# it have the 16 byte rx FIFO of the front panel UART, the timeline doesn't show data the
+# front panel would have lost to overruns. tools/ispsim/ispsim.c runs the front panel's
+# isputils.c itself against a model of the link that does, use that for the loader timing.
+
+import argparse
+import binascii
+import os
+import random
+import select
+import sys
+import time
+import tty
+
+RAM_START = 0x10000000
+RAM_END = 0x10002000
+ISP_RAM_END = 0x10000300  # ISP uses RAM below this
+ISP_STACK_START = RAM_END - 32 - 256  # ISP uses the top 32 bytes and 256 bytes stack
+
+ROW_SIZE = 45
+ROWS_PER_BLOCK = 20
+UNLOCK_CODE = 23130
+
+# ISP return codes
+CMD_SUCCESS = 0
+INVALID_COMMAND = 1
+COUNT_ERROR = 6
+ADDR_ERROR = 13
+ADDR_NOT_MAPPED = 14
+CMD_LOCKED = 15
+PARAM_ERROR = 19
+
+
+class Emulator:
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.args = args
+        self.byte_time = 10.0 / args.baud  # 8N1
+        self.rng = random.Random(args.seed)
+        self.ram = bytearray(RAM_END - RAM_START)
+        self.reset()
+
+    def reset(self):
+        self.synced = False
+        self.echo = True
+        self.unlocked = False
+        self.line = bytearray()
+        self.write = None  # [address, count, received, block data, rows]
+        self.read = None  # [address, count, start of the block being sent]
+        self.sync_ignored = 0
+        self.blocks = 0
+        self.resends = 0
+        self.dropped = 0
+        self.bytes_in = 0
+        self.bytes_out = 0
+        self.t0 = None
+        self.timeline = []
+        self.done = False
+        self.forced = set()  # Blocks in --resend already answered with RESEND
+
+    def event(self, text):
+        now = time.monotonic()
+        wire = (self.bytes_in + self.bytes_out) * self.byte_time
+        self.timeline.append((now - self.t0, wire, text))
+        if self.args.verbose:
+            print("%9.3f ms %9.3f ms  %s" % ((now - self.t0) * 1000, wire * 1000, text))
+
+    def send(self, text):
+        if self.args.delay:
+            time.sleep(self.args.delay / 1000)
+        data = text.encode()
+        self.bytes_out += len(data)
+        os.write(self.fd, data)
+        # Pace the output like the real UART would
+        time.sleep(len(data) * self.byte_time)
+
+    def result(self, code):
+        self.send("%d\r\n" % code)
+
+    def feed(self, byte):
+        if self.t0 is None:
+            self.t0 = time.monotonic()
+        self.bytes_in += 1
+        if self.args.drop and self.rng.random() < self.args.drop:
+            self.dropped += 1
+            return
+
+        if not self.synced:
+            if byte == ord("?"):
+                if self.sync_ignored < self.args.ignore_sync:
+                    self.sync_ignored += 1  # Still booting
+                    return
+                self.event("? received")
+                self.send("Synchronized\r\n")
+                self.synced = True
+            return
+
+        if self.echo:
+            self.bytes_out += 1
+            os.write(self.fd, bytes([byte]))
+        if byte == ord("\n"):
+            line = self.line.rstrip(b"\r")
+            self.line = bytearray()
+            self.handle(line)
+        else:
+            self.line.append(byte)
+
+    def handle(self, line):
+        if self.write:
+            self.handle_data(line)
+            return
+        if self.read:
+            self.handle_read_ack(line)
+            return
+        words = line.decode(errors="replace").split()
+        if not words:
+            return
+        cmd = words[0]
+        if cmd == "Synchronized":
+            self.event("synchronized")
+            self.send("OK\r\n")
+        elif cmd.isdigit() and len(words) == 1:
+            self.event("crystal %s kHz" % cmd)
+            self.send("OK\r\n")
+        elif cmd == "A" and len(words) == 2 and words[1] in ("0", "1"):
+            self.result(CMD_SUCCESS)
+            self.echo = words[1] == "1"
+            self.event("echo %s" % ("on" if self.echo else "off"))
+        elif cmd == "U" and len(words) == 2:
+            self.unlocked = words[1] == str(UNLOCK_CODE)
+            self.event("unlock %s" % ("ok" if self.unlocked else "bad code"))
+            self.result(CMD_SUCCESS if self.unlocked else PARAM_ERROR)
+        elif cmd == "W" and len(words) == 3:
+            self.cmd_write(int(words[1]), int(words[2]))
+        elif cmd == "R" and len(words) == 3:
+            self.cmd_read(int(words[1]), int(words[2]))
+        elif cmd == "G" and len(words) == 3:
+            self.cmd_go(int(words[1]), words[2])
+        else:
+            self.event("invalid command %r" % line)
+            self.result(INVALID_COMMAND)
+
+    def cmd_write(self, address, count):
+        if address & 3:
+            self.result(ADDR_ERROR)
+        elif count & 3:
+            self.result(COUNT_ERROR)
+        elif address < ISP_RAM_END or address + count > ISP_STACK_START:
+            self.result(ADDR_NOT_MAPPED)
+        else:
+            self.event("W 0x%08x %d" % (address, count))
+            self.write = [address, count, 0, bytearray(), 0]
+            self.result(CMD_SUCCESS)
+
+    def handle_data(self, line):
+        address, count, received, block, rows = self.write
+        if rows < ROWS_PER_BLOCK and received + len(block) < count:
+            try:
+                data = binascii.a2b_uu(line)
+            except binascii.Error:
+                data = b""  # Garbled, the checksum will tell
+            self.write[3] += data
+            self.write[4] += 1
+            return
+
+        try:
+            checksum = int(line)
+        except ValueError:
+            checksum = -1
+        forced = self.blocks + 1 in self.args.resend and self.blocks + 1 not in self.forced
+        if forced:
+            self.forced.add(self.blocks + 1)
+        if checksum != sum(block) or forced or (self.args.bad_checksum and
+                                                self.rng.random() < self.args.bad_checksum):
+            self.resends += 1
+            self.event("block %d RESEND" % (self.blocks + 1))
+            self.send("RESEND\r\n")
+        else:
+            start = address - RAM_START + received
+            self.ram[start:start + len(block)] = block[:count - received]
+            self.write[2] += len(block)
+            self.blocks += 1
+            self.event("block %d OK (%d bytes)" % (self.blocks, self.write[2]))
+            self.send("OK\r\n")
+        self.write[3] = bytearray()
+        self.write[4] = 0
+        if self.write[2] >= count:
+            self.write = None
+
+    def cmd_read(self, address, count):
+        if address & 3:
+            self.result(ADDR_ERROR)
+        elif count & 3:
+            self.result(COUNT_ERROR)
+        elif not RAM_START <= address or address + count > RAM_END:
+            self.result(ADDR_NOT_MAPPED)
+        else:
+            self.event("R 0x%08x %d" % (address, count))
+            self.result(CMD_SUCCESS)
+            self.read = [address, count, 0]
+            self.send_read_block()
+
+    def send_read_block(self):
+        address, count, sent = self.read
+        start = address - RAM_START + sent
+        data = self.ram[start:start + min(count - sent, ROW_SIZE * ROWS_PER_BLOCK)]
+        text = b"".join(binascii.b2a_uu(data[i:i + ROW_SIZE], backtick=True).replace(b"\n", b"\r\n")
+                        for i in range(0, len(data), ROW_SIZE))
+        self.send(text.decode() + "%d\r\n" % sum(data))
+        self.read_block_size = len(data)
+
+    def handle_read_ack(self, line):
+        if line == b"OK":
+            self.read[2] += self.read_block_size
+            self.event("read block OK (%d bytes)" % self.read[2])
+            if self.read[2] >= self.read[1]:
+                self.read = None
+                return
+        else:
+            self.resends += 1
+            self.event("read block %r" % line)
+        self.send_read_block()
+
+    def cmd_go(self, address, mode):
+        if not self.unlocked:
+            self.result(CMD_LOCKED)
+        elif mode != "T" or address & 1 or not RAM_START <= address < RAM_END:
+            self.result(ADDR_ERROR)
+        else:
+            self.event("G 0x%08x" % address)
+            self.result(CMD_SUCCESS)
+            self.done = True
+
+    def report(self):
+        real, wire, _ = self.timeline[-1]
+        print("Timeline (real, wire time at %d baud):" % self.args.baud)
+        for t, w, text in self.timeline:
+            print("%9.3f ms %9.3f ms  %s" % (t * 1000, w * 1000, text))
+        print("%d bytes in, %d out, %d blocks, %d resends, %d bytes dropped" %
+              (self.bytes_in, self.bytes_out, self.blocks, self.resends, self.dropped))
+        print("Total %.1f ms real, %.1f ms on the wire" % (real * 1000, wire * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="LPC1315 ISP bootloader emulator on a pty")
+    parser.add_argument("--baud", type=int, default=230400, help="modelled line rate")
+    parser.add_argument("--drop", type=float, default=0, help="probability of losing a received byte")
+    parser.add_argument("--bad-checksum", type=float, default=0,
+                        help="probability of answering RESEND to a good block")
+    parser.add_argument("--resend", type=int, action="append", default=[],
+                        help="answer RESEND to this block (1-based) once, can be repeated")
+    parser.add_argument("--delay", type=float, default=0, help="ms before every response")
+    parser.add_argument("--ignore-sync", type=int, default=0,
+                        help="ignore this many ? (riser still coming out of reset)")
+    parser.add_argument("--seed", type=int, default=None, help="random seed for the faults")
+    parser.add_argument("--dump", help="write RAM to this file after G")
+    parser.add_argument("--loop", action="store_true", help="start over after G")
+    parser.add_argument("--verbose", "-v", action="store_true", help="print events as they happen")
+    args = parser.parse_args()
+
+    master, slave = os.openpty()
+    tty.setraw(slave)  # No newline translation or echo by the line discipline
+    print("ISP emulator on %s" % os.ttyname(slave), flush=True)
+
+    emu = Emulator(master, args)
+    try:
+        while True:
+            ready, _, _ = select.select([master], [], [])
+            try:
+                data = os.read(master, 256)
+            except OSError:
+                continue  # Nothing has the pty open (yet)
+            for byte in data:
+                emu.feed(byte)
+                if emu.done:
+                    break
+            if emu.done:
+                emu.report()
+                if args.dump:
+                    with open(args.dump, "wb") as f:
+                        f.write(emu.ram)
+                if not args.loop:
+                    break
+                emu.reset()
+    except KeyboardInterrupt:
+        if emu.timeline:
+            emu.report()
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
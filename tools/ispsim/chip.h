@@ -0,0 +1,57 @@
+/*
+ * chip.h - Host stand-in for the LPCOpen chip header, see ispsim.c
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIP_H_
+#define CHIP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Only what isputils.c and gpiomap.h use, the UART functions are the emulated riser link
+typedef struct {
+	uint32_t SET;
+	uint32_t CLR;
+} LPC_GPIO_T;
+
+typedef struct {
+	uint32_t chnum;
+} LPC_USART_T;
+
+// Every use of LPC_GPIO gets a fresh set of ports, so the writes of gpiomap.h are seen
+// one by one and in order even when they are to the same port
+LPC_GPIO_T* sim_gpio_write(void);
+extern LPC_USART_T sim_uart[2];
+#define LPC_GPIO (sim_gpio_write())
+#define LPC_UART0 (&sim_uart[0])
+#define LPC_UART1 (&sim_uart[1])
+
+#define UART_FCR_FIFO_EN (1 << 0)
+#define UART_FCR_RX_RS (1 << 1)
+#define UART_FCR_TX_RS (1 << 2)
+#define UART_LSR_RDR (1 << 0)
+#define UART_LSR_THRE (1 << 5)
+
+void Chip_UART_SetupFIFOS(LPC_USART_T* pUART, uint32_t fcr);
+uint32_t Chip_UART_ReadLineStatus(LPC_USART_T* pUART);
+void Chip_UART_SendByte(LPC_USART_T* pUART, uint8_t data);
+uint8_t Chip_UART_ReadByte(LPC_USART_T* pUART);
+int Chip_UART_Read(LPC_USART_T* pUART, void* data, int numBytes);
+int Chip_UART_SendBlocking(LPC_USART_T* pUART, const void* data, int numBytes);
+uint32_t Chip_UART_SetBaudFDR(LPC_USART_T* pUART, uint32_t baudrate);
+
+#endif /* CHIP_H_ */
@@ -0,0 +1,604 @@
+/*
+ * ispsim.c - Run the front panel ISP loader against emulated riser bootloaders
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Builds the firmware's isputils.c on the host and runs isp_mode on a ps2k-riser.isp,
+// both channels at once, the way the front panel does at boot:
+//   cc -O2 -Wall -Itools/ispsim -Ips2k-front/src -o ispsim tools/ispsim/ispsim.c ps2k-front/src/isputils.c
+//   ./ispsim -v ps2k-riser/Debug/ps2k-riser.isp
+//
+// Unlike tools/ispemu.py on a pty, this models the UART link itself. Every character
+// takes 10 bit times at the rate Chip_UART_SetBaudFDR really gives with the 24MHz PCLK.
+// The front panel's tx FIFO drains at that rate, and its rx FIFO holds 16 characters. A
+// character arriving when the rx FIFO is full is lost and counted as an overrun, like on
+// the UART. Simulated time moves on in vTaskDelay (to the next tick), taskYIELD and
+// every UART access. With -s, higher priority tasks also keep the CPU for a while after
+// every tick.
+//
+// The emulated bootloaders implement what isputils.c uses: ? autobaud, Synchronized, the
+// crystal frequency, echo, A, U, W (uuencoded rows, checksum after every 20), R and G.
+// They answer as soon as the last character of a command is in. The reset and ISP pins
+// are taken from the GPIO writes of gpiomap.h.
+//
+// Faults, channels numbered from 1 as on the front panel:
+//   -d ch        channel doesn't answer (not fitted)
+//   -c ch:block  wrong checksum reported for data block number block (counting resends) once
+//   -f ch        a bit in riser RAM flips after the write, the readback has to catch it
+//   -b baud      highest rate the bootloaders lock on to
+//   -s us        CPU taken by higher priority tasks after every tick
+//
+// Prints a timeline of the loader states with -v and a summary per channel. Exits with 1
+// if a channel that answers didn't load, or its RAM didn't hold the blob when told to go.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "isputils.h"
+#include "gpiomap.h"
+#include "task.h"
+
+#define PCLK_HZ (24000000)
+#define NS_PER_TICK (1000000)
+#define UART_ACCESS_NS (250) // Call and register access at 96MHz, roughly
+#define YIELD_NS (2000) // Nothing else ready at the same priority
+#define RX_FIFO_SIZE (16)
+#define TX_FIFO_SIZE (16)
+#define OUT_QUEUE_SIZE (4096) // More than a readback block with its checksum line
+
+#define RAM_BASE (0x10000000)
+#define RAM_SIZE (0x2000)
+#define ROW_SIZE (45)
+#define ROWS_PER_BLOCK (20)
+#define MAX_STREAM (64 * 1024)
+#define GPIO_LOG_SIZE (16)
+#define GPIO_NUM_PORTS (5)
+
+typedef enum {
+	BL_OFF = 0, // In reset, running its flash image, or not fitted
+	BL_SYNC, // Waiting for ?
+	BL_SYNC_ACK, // Waiting for Synchronized
+	BL_CLOCK, // Waiting for the crystal frequency
+	BL_CMD,
+	BL_WRITE, // Receiving W data
+	BL_READ, // Waiting for OK/RESEND after a R block
+} bl_state_t;
+
+typedef struct {
+	// Front panel UART
+	uint32_t baud;
+	uint64_t tx_end; // When the last character written to THR is off the wire
+	uint8_t rx_fifo[RX_FIFO_SIZE];
+	uint32_t rx_head;
+	uint32_t rx_len;
+	uint32_t rx_max;
+	uint32_t overruns;
+	uint32_t tx_overflows;
+	// Characters sent by the riser, with the time each has been completely received
+	uint8_t out[OUT_QUEUE_SIZE];
+	uint64_t out_at[OUT_QUEUE_SIZE];
+	uint32_t out_head;
+	uint32_t out_len;
+	uint64_t out_end;
+	// Pins
+	bool reset_low;
+	bool isp_low;
+	// Bootloader
+	bl_state_t state;
+	uint32_t baud_locked;
+	bool echo;
+	char line[128];
+	uint32_t line_len;
+	uint8_t ram[RAM_SIZE];
+	uint32_t addr; // W/R in progress
+	uint32_t len;
+	uint32_t pos;
+	uint32_t block_pos;
+	uint32_t rows;
+	uint32_t data_blocks;
+	bool went;
+	bool go_ok;
+	// Faults
+	bool dead;
+	int32_t bad_block;
+	bool flip;
+	// Timeline
+	isp_state_t last_state;
+} riser_t;
+
+LPC_USART_T sim_uart[2] = {{0}, {1}};
+
+// The .incbin of modulefw.s, isputils.c sees this as its isp_stream_t
+uint32_t modulefw[MAX_STREAM / 4];
+
+static riser_t s_riser[NUM_CHANNELS];
+static uint64_t s_now_ns;
+static uint64_t s_stall_ns;
+static uint32_t s_max_baud = 1000000;
+static bool s_verbose;
+static uint8_t s_blob[RAM_SIZE];
+static LPC_GPIO_T s_gpio_log[GPIO_LOG_SIZE][GPIO_NUM_PORTS];
+static uint32_t s_gpio_log_len;
+
+static void sim_update(void);
+
+static void sim_advance(uint64_t ns) {
+	uint64_t tick = s_now_ns / NS_PER_TICK;
+	s_now_ns += ns;
+	if (s_now_ns / NS_PER_TICK != tick) s_now_ns += s_stall_ns; // Higher priority tasks first
+	sim_update();
+}
+
+TickType_t xTaskGetTickCount(void) {
+	return s_now_ns / NS_PER_TICK;
+}
+
+void vTaskDelay(TickType_t ticks) {
+	s_now_ns = (s_now_ns / NS_PER_TICK + ticks) * NS_PER_TICK + s_stall_ns;
+	sim_update();
+}
+
+void sim_yield(void) {
+	sim_advance(YIELD_NS);
+}
+
+static uint64_t char_ns(uint32_t baud) {
+	return 10 * 1000000000ull / baud;
+}
+
+static riser_t* riser(LPC_USART_T* pUART) {
+	return &s_riser[pUART->chnum];
+}
+
+// Riser -> front panel, queued from when the riser has the response ready
+static void riser_send(riser_t* r, uint64_t ready, const char* str) {
+	for (; *str; str++) {
+		if (r->out_len == OUT_QUEUE_SIZE) {
+			fprintf(stderr, "ispsim: riser output queue full\n");
+			exit(2);
+		}
+		uint64_t at = (ready > r->out_end ? ready : r->out_end) + char_ns(r->baud_locked);
+		uint32_t i = (r->out_head + r->out_len++) % OUT_QUEUE_SIZE;
+		r->out[i] = *str;
+		r->out_at[i] = at;
+		r->out_end = at;
+	}
+}
+
+// Move what has arrived by now into the rx FIFO
+static void riser_settle(riser_t* r) {
+	while (r->out_len && r->out_at[r->out_head] <= s_now_ns) {
+		if (r->rx_len < RX_FIFO_SIZE) {
+			r->rx_fifo[(r->rx_head + r->rx_len++) % RX_FIFO_SIZE] = r->out[r->out_head];
+			if (r->rx_len > r->rx_max) r->rx_max = r->rx_len;
+		} else {
+			r->overruns++;
+		}
+		r->out_head = (r->out_head + 1) % OUT_QUEUE_SIZE;
+		r->out_len--;
+	}
+}
+
+static uint32_t uudecode_row(const char* line, uint8_t* dst) {
+	uint32_t n = (line[0] - 0x20) & 0x3f;
+	const char* p = &line[1];
+	for (uint32_t i = 0; i < n; i += 3) {
+		uint32_t group = 0;
+		for (uint32_t j = 0; j < 4; j++) group = group << 6 | ((*p++ - 0x20) & 0x3f);
+		for (uint32_t j = 0; j < 3 && i + j < n; j++) dst[i + j] = group >> (16 - 8 * j);
+	}
+	return n;
+}
+
+static void uuencode_row(char* line, const uint8_t* src, uint32_t n) {
+	*line++ = 0x20 + n;
+	for (uint32_t i = 0; i < n; i += 3) {
+		uint32_t group = 0;
+		for (uint32_t j = 0; j < 3; j++) group = group << 8 | (i + j < n ? src[i + j] : 0);
+		for (int32_t j = 3; j >= 0; j--) {
+			uint32_t c = (group >> (6 * j)) & 0x3f;
+			*line++ = c ? 0x20 + c : 0x60;
+		}
+	}
+	strcpy(line, "\r\n");
+}
+
+static uint32_t ram_sum(const riser_t* r, uint32_t from, uint32_t to) {
+	uint32_t sum = 0;
+	for (uint32_t i = from; i < to; i++) sum += r->ram[i - RAM_BASE];
+	return sum;
+}
+
+static bool ram_range(uint32_t addr, uint32_t len) {
+	return addr >= RAM_BASE && len <= RAM_SIZE && addr - RAM_BASE <= RAM_SIZE - len;
+}
+
+// Next block of the R response, rows followed by the checksum line
+static void riser_read_block(riser_t* r, uint64_t ready) {
+	char line[80];
+	r->block_pos = r->pos;
+	for (uint32_t row = 0; row < ROWS_PER_BLOCK && r->pos < r->addr + r->len; row++) {
+		uint32_t n = r->addr + r->len - r->pos < ROW_SIZE ? r->addr + r->len - r->pos : ROW_SIZE;
+		uuencode_row(line, &r->ram[r->pos - RAM_BASE], n);
+		riser_send(r, ready, line);
+		r->pos += n;
+	}
+	sprintf(line, "%u\r\n", ram_sum(r, r->block_pos, r->pos));
+	riser_send(r, ready, line);
+	r->state = BL_READ;
+}
+
+static void riser_line(riser_t* r, uint64_t ready) {
+	char* line = r->line;
+	uint32_t arg1, arg2;
+	switch (r->state) {
+	case BL_SYNC_ACK:
+		if (!strcmp(line, "Synchronized")) {
+			riser_send(r, ready, "OK\r\n");
+			r->state = BL_CLOCK;
+		}
+		return;
+	case BL_CLOCK:
+		riser_send(r, ready, "OK\r\n");
+		r->state = BL_CMD;
+		return;
+	case BL_WRITE:
+		if (r->rows < ROWS_PER_BLOCK && r->pos < r->addr + r->len) {
+			uint8_t data[64];
+			uint32_t n = uudecode_row(line, data);
+			if (n > r->addr + r->len - r->pos) n = r->addr + r->len - r->pos;
+			memcpy(&r->ram[r->pos - RAM_BASE], data, n);
+			r->pos += n;
+			r->rows++;
+			return;
+		}
+		// Checksum line
+		uint32_t sum = ram_sum(r, r->block_pos, r->pos);
+		if ((int32_t)r->data_blocks++ == r->bad_block) sum++;
+		r->rows = 0;
+		if (strtoul(line, NULL, 10) != sum) {
+			riser_send(r, ready, "RESEND\r\n");
+			r->pos = r->block_pos;
+			return;
+		}
+		riser_send(r, ready, "OK\r\n");
+		r->block_pos = r->pos;
+		if (r->pos == r->addr + r->len) {
+			r->state = BL_CMD;
+			if (r->flip) {
+				r->ram[r->addr + r->len / 2 - RAM_BASE] ^= 0x10;
+				r->flip = false;
+			}
+		}
+		return;
+	case BL_READ:
+		if (!strcmp(line, "RESEND")) {
+			r->pos = r->block_pos;
+			riser_read_block(r, ready);
+		} else if (r->pos < r->addr + r->len) {
+			riser_read_block(r, ready);
+		} else {
+			r->state = BL_CMD;
+		}
+		return;
+	default:
+		break;
+	}
+
+	if (!strcmp(line, "A 0") || !strcmp(line, "A 1")) {
+		r->echo = line[2] == '1';
+		riser_send(r, ready, "0\r\n");
+	} else if (!strcmp(line, "U 23130")) {
+		riser_send(r, ready, "0\r\n");
+	} else if (sscanf(line, "W %u %u", &arg1, &arg2) == 2) {
+		if (!ram_range(arg1, arg2) || (arg1 & 3) || (arg2 & 3)) {
+			riser_send(r, ready, "14\r\n");
+			return;
+		}
+		riser_send(r, ready, "0\r\n");
+		r->addr = arg1;
+		r->len = arg2;
+		r->pos = r->block_pos = arg1;
+		r->rows = 0;
+		r->state = BL_WRITE;
+	} else if (sscanf(line, "R %u %u", &arg1, &arg2) == 2) {
+		if (!ram_range(arg1, arg2)) {
+			riser_send(r, ready, "14\r\n");
+			return;
+		}
+		riser_send(r, ready, "0\r\n");
+		r->addr = arg1;
+		r->len = arg2;
+		r->pos = arg1;
+		riser_read_block(r, ready);
+	} else if (sscanf(line, "G %u T", &arg1) == 1) {
+		riser_send(r, ready, "0\r\n");
+		// The stub takes over from here, check that it would find what lzpack.py put there
+		uint32_t load = modulefw[0], exec = modulefw[1], size = modulefw[2];
+		r->went = true;
+		r->go_ok = arg1 == exec && ram_range(load, size) &&
+				!memcmp(&r->ram[load - RAM_BASE], s_blob, size);
+		r->state = BL_OFF;
+	} else {
+		riser_send(r, ready, "1\r\n");
+	}
+}
+
+// Front panel -> riser, the character is in at the given time
+static void riser_receive(riser_t* r, uint8_t c, uint64_t at) {
+	if (r->dead || r->state == BL_OFF) return;
+	if (r->state == BL_SYNC) {
+		if (c == '?' && r->baud <= s_max_baud) {
+			r->baud_locked = r->baud;
+			r->echo = true;
+			r->line_len = 0;
+			riser_send(r, at, "Synchronized\r\n");
+			r->state = BL_SYNC_ACK;
+		}
+		return;
+	}
+	if (r->baud != r->baud_locked) return; // Garbage to the riser
+	if (r->echo) {
+		char str[2] = {c, '\0'};
+		riser_send(r, at, str);
+	}
+	if (c == '\n') {
+		if (r->line_len && r->line[r->line_len - 1] == '\r') r->line_len--;
+		r->line[r->line_len] = '\0';
+		r->line_len = 0;
+		riser_line(r, at);
+	} else if (r->line_len < sizeof(r->line) - 1) {
+		r->line[r->line_len++] = c;
+	}
+}
+
+LPC_GPIO_T* sim_gpio_write(void) {
+	if (s_gpio_log_len == GPIO_LOG_SIZE) {
+		fprintf(stderr, "ispsim: GPIO write log full\n");
+		exit(2);
+	}
+	LPC_GPIO_T* ports = s_gpio_log[s_gpio_log_len++];
+	memset(ports, 0, sizeof(s_gpio_log[0]));
+	return ports;
+}
+
+static void riser_pins(riser_t* r, uint32_t chnum, const LPC_GPIO_T* ports) {
+	const LPC_GPIO_T* reset = &ports[CHx_RESET_PORT(chnum)];
+	const LPC_GPIO_T* isp = &ports[CHx_ISP_PORT(chnum)];
+	if (isp->CLR & _BV(CHx_ISP_BIT(chnum))) r->isp_low = true;
+	if (isp->SET & _BV(CHx_ISP_BIT(chnum))) r->isp_low = false;
+	if (reset->CLR & _BV(CHx_RESET_BIT(chnum))) {
+		r->reset_low = true;
+		r->state = BL_OFF;
+		r->out_len = 0;
+	}
+	if ((reset->SET & _BV(CHx_RESET_BIT(chnum))) && r->reset_low) {
+		// Out of reset, the ISP pin decides between the bootloader and the flash image
+		r->reset_low = false;
+		r->state = r->isp_low ? BL_SYNC : BL_OFF;
+		r->line_len = 0;
+		r->out_end = s_now_ns;
+	}
+}
+
+// Follow the pins, and the loader states for the timeline
+static void sim_update(void) {
+	for (uint32_t i = 0; i < s_gpio_log_len; i++) {
+		for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) riser_pins(&s_riser[chnum], chnum, s_gpio_log[i]);
+	}
+	s_gpio_log_len = 0;
+
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		riser_t* r = &s_riser[chnum];
+		const isp_status_t* status = isp_get_status(chnum);
+		if (s_verbose && status->state != r->last_state) {
+			printf("%9.3fms ch%u %s", s_now_ns / 1e6, chnum + 1, isp_state_name(status->state));
+			if (status->state == ISP_SYNC) printf(" at %u baud", status->baud);
+			if (status->state == ISP_FAILED) printf(" in %s", isp_state_name(status->failed_step));
+			printf(", %u overruns so far\n", r->overruns);
+		}
+		r->last_state = status->state;
+	}
+}
+
+void Chip_UART_SetupFIFOS(LPC_USART_T* pUART, uint32_t fcr) {
+	riser_t* r = riser(pUART);
+	sim_advance(UART_ACCESS_NS);
+	if (fcr & UART_FCR_RX_RS) r->rx_len = 0;
+}
+
+uint32_t Chip_UART_ReadLineStatus(LPC_USART_T* pUART) {
+	riser_t* r = riser(pUART);
+	sim_advance(UART_ACCESS_NS);
+	riser_settle(r);
+	uint32_t lsr = r->rx_len ? UART_LSR_RDR : 0;
+	// THR and its FIFO are empty once the last character is in the shift register
+	if (s_now_ns + char_ns(r->baud) >= r->tx_end) lsr |= UART_LSR_THRE;
+	return lsr;
+}
+
+void Chip_UART_SendByte(LPC_USART_T* pUART, uint8_t data) {
+	riser_t* r = riser(pUART);
+	sim_advance(UART_ACCESS_NS);
+	uint64_t queued = r->tx_end > s_now_ns ? (r->tx_end - s_now_ns) / char_ns(r->baud) : 0;
+	if (queued > TX_FIFO_SIZE) {
+		// Written to a full FIFO, lost
+		r->tx_overflows++;
+		return;
+	}
+	r->tx_end = (r->tx_end > s_now_ns ? r->tx_end : s_now_ns) + char_ns(r->baud);
+	riser_receive(r, data, r->tx_end);
+}
+
+uint8_t Chip_UART_ReadByte(LPC_USART_T* pUART) {
+	uint8_t data = 0;
+	Chip_UART_Read(pUART, &data, 1);
+	return data;
+}
+
+int Chip_UART_Read(LPC_USART_T* pUART, void* data, int numBytes) {
+	riser_t* r = riser(pUART);
+	sim_advance(UART_ACCESS_NS);
+	riser_settle(r);
+	int num = 0;
+	while (num < numBytes && r->rx_len) {
+		((uint8_t*)data)[num++] = r->rx_fifo[r->rx_head];
+		r->rx_head = (r->rx_head + 1) % RX_FIFO_SIZE;
+		r->rx_len--;
+	}
+	return num;
+}
+
+int Chip_UART_SendBlocking(LPC_USART_T* pUART, const void* data, int numBytes) {
+	for (int i = 0; i < numBytes; i++) {
+		while (!(Chip_UART_ReadLineStatus(pUART) & UART_LSR_THRE));
+		Chip_UART_SendByte(pUART, ((const uint8_t*)data)[i]);
+	}
+	return numBytes;
+}
+
+// Same divider search as the chip library, returns the rate actually used
+uint32_t Chip_UART_SetBaudFDR(LPC_USART_T* pUART, uint32_t baudrate) {
+	uint32_t best_error = 0xffffffff, best_dl = 0, best_m = 0, best_d = 0;
+	for (uint32_t m = 1; m <= 15 && best_error; m++) {
+		for (uint32_t d = 0; d < m; d++) {
+			uint64_t divisor = ((uint64_t)PCLK_HZ << 28) * m / (baudrate * (m + d));
+			uint32_t error = divisor & 0xffffffff;
+			uint32_t dl = divisor >> 32;
+			if (error > (1u << 31)) {
+				dl++;
+				error = -error;
+			}
+			if (dl < 1 || dl > 65535 || (d && dl < 3)) continue;
+			if (error < best_error) {
+				best_error = error;
+				best_dl = dl;
+				best_m = m;
+				best_d = d;
+				if (!error) break;
+			}
+		}
+	}
+	riser_t* r = riser(pUART);
+	sim_advance(UART_ACCESS_NS);
+	r->baud = (PCLK_HZ >> 4) * best_m / (best_dl * (best_m + best_d));
+	return r->baud;
+}
+
+// The blob as lzpack.py made it, decoded from the text with the block table
+static uint32_t decode_stream(void) {
+	uint32_t size = modulefw[2], num_blocks = modulefw[4];
+	const char* text = (const char*)&modulefw[5 + num_blocks];
+	const char* p = text;
+	uint32_t pos = 0;
+	if (size > RAM_SIZE || num_blocks > MAX_STREAM / 4) return 0;
+	for (uint32_t block = 0; block < num_blocks; block++) {
+		for (uint32_t row = 0; row < ROWS_PER_BLOCK && pos < size; row++) {
+			uint32_t n = uudecode_row(p, &s_blob[pos]);
+			if (n > size - pos) return 0;
+			pos += n;
+			p = strchr(p, '\n') + 1;
+		}
+		p = strchr(p, '\n') + 1; // Checksum line
+		if ((uint32_t)(p - text) != modulefw[5 + block]) return 0;
+	}
+	return pos == size ? size : 0;
+}
+
+static uint32_t parse_ch(const char* arg) {
+	uint32_t ch = strtoul(arg, NULL, 10);
+	if (ch < 1 || ch > NUM_CHANNELS) {
+		fprintf(stderr, "ispsim: no channel %s\n", arg);
+		exit(2);
+	}
+	return ch - 1;
+}
+
+int main(int argc, char** argv) {
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		s_riser[chnum].baud = 500000;
+		s_riser[chnum].bad_block = -1;
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:c:f:b:s:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			s_riser[parse_ch(optarg)].dead = true;
+			break;
+		case 'c': {
+			const char* block = strchr(optarg, ':');
+			s_riser[parse_ch(optarg)].bad_block = block ? atoi(block + 1) : 0;
+			break;
+		}
+		case 'f':
+			s_riser[parse_ch(optarg)].flip = true;
+			break;
+		case 'b':
+			s_max_baud = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			s_stall_ns = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'v':
+			s_verbose = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d ch] [-c ch:block] [-f ch] [-b baud] [-s us] [-v] ps2k-riser.isp\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-d ch] [-c ch:block] [-f ch] [-b baud] [-s us] [-v] ps2k-riser.isp\n", argv[0]);
+		return 2;
+	}
+
+	FILE* f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 2;
+	}
+	size_t len = fread(modulefw, 1, sizeof(modulefw) - 1, f);
+	fclose(f);
+	if (len < 20 || !decode_stream()) {
+		fprintf(stderr, "ispsim: %s isn't a valid ISP stream\n", argv[optind]);
+		return 2;
+	}
+	printf("%u byte blob in %u blocks, loaded at 0x%08x, stub at 0x%08x\n",
+			modulefw[2], modulefw[4], modulefw[0], modulefw[1]);
+
+	uint32_t all = _BV(NUM_CHANNELS) - 1;
+	uint32_t done = isp_mode(all);
+	sim_update();
+	printf("isp_mode returned after %.3fms\n", s_now_ns / 1e6);
+
+	int result = 0;
+	for (uint32_t chnum = 0; chnum < NUM_CHANNELS; chnum++) {
+		const isp_status_t* status = isp_get_status(chnum);
+		const riser_t* r = &s_riser[chnum];
+		printf("ch%u %s", chnum + 1, isp_state_name(status->state));
+		if (status->state == ISP_FAILED) printf(" in %s", isp_state_name(status->failed_step));
+		printf(", %u baud, %u fallbacks, %u restarts, %u retries, %u blocks, load %ums (verify %ums)\n",
+				status->baud, status->fallbacks, status->restarts, status->retries, status->blocks, status->load_ms, status->verify_ms);
+		printf("    rx FIFO max %u/%u, %u overruns, %u tx FIFO overflows, %s\n", r->rx_max, RX_FIFO_SIZE,
+				r->overruns, r->tx_overflows, !r->went ? "not started" : r->go_ok ? "started with the blob in RAM" : "STARTED WITH BAD RAM");
+		if (r->went && !r->go_ok) result = 1;
+		if (!r->dead && !(done & _BV(chnum))) result = 1;
+	}
+	return result;
+}
@@ -0,0 +1,29 @@
+/*
+ * task.h - Host stand-in for the FreeRTOS task API, see ispsim.c
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TASK_H_
+#define TASK_H_
+
+#include "FreeRTOS.h"
+
+// Simulated time only moves in these and in the UART accesses
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+void sim_yield(void);
+#define taskYIELD() sim_yield()
+
+#endif /* TASK_H_ */
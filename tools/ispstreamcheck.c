@@ -0,0 +1,196 @@
+/*
+ * ispstreamcheck.c - Compare the build time ISP stream with the old runtime encoder
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The front panel used to uuencode the riser blob and append the block checksums at run
+// time, lzpack.py now does that at build time. This checks that a ps2k-riser.isp is
+// byte for byte what the front panel used to send for the same blob:
+//   cc -O2 -Wall -o ispstreamcheck tools/ispstreamcheck.c
+//   ./ispstreamcheck ps2k-riser/Debug/ps2k-riser.isp
+//
+// The blob is recovered from the stream with a plain uudecode, then fed through the
+// runtime encoder as it was in isputils.c (uuencode, num2ascii and the block framing of
+// isp_queue_row, copied unchanged). The result has to match the text and the block table.
+// lzpack.py's own check on every build only decodes its output again, which wouldn't
+// catch an encoding the ISP accepts differently from what was always sent.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ISP_ROWS_PER_BLOCK (20)
+#define MAX_BLOB (8192)
+
+// From isputils.c before the stream was pre-encoded
+static uint32_t uuencode(char* dst, uint8_t* src, uint32_t srclen) {
+	if (srclen > 45) return 0;
+
+	uint32_t len = 0;
+	dst[len++] = 0x20 + srclen;
+
+	for (uint32_t i = 0; i < srclen ; i += 3) {
+		uint32_t uugroup = src[i] << 16 |
+				((i < (srclen-1)) ? src[i + 1] << 8 : 0) |
+				((i < (srclen-2)) ? src[i + 2] : 0);
+		for (uint32_t j = 0; j < 4; j++) {
+			if (uugroup & (0b111111 << 18)) { // non-zero 6-bit char
+				uugroup += (0x20 << 18); // only add 0x20 to the 6-bit char
+			} else {
+				uugroup += (0x60 << 18); // add 0x60
+			}
+			dst[len++] = (uint8_t)(uugroup >> 18);
+			// Make sure we don't have any left-overs from last byte
+			uugroup &= (1 << 18) - 1;
+			uugroup <<= 6; // next 6-bit chunk
+
+		}
+	}
+	dst[len++] = '\r';
+	dst[len++] = '\n';
+	return len;
+}
+
+static uint32_t num2ascii(char* outbuf, uint32_t num) {
+	// Returns number of characters which will be used even if outbuf is NULL
+	uint32_t digits;
+	if (num != 0) {
+		uint32_t tmp = num;
+		digits = 0;
+		while (tmp != 0) {
+			tmp /= 10;
+			digits++;
+		}
+	} else {
+		digits = 1;
+	}
+
+	if (outbuf) {
+		uint32_t loop = digits;
+		while (loop--) {
+			outbuf[loop] = '0' + num % 10;
+			num /= 10;
+		}
+	}
+	return digits;
+}
+
+static uint32_t calc_checksum(uint8_t* buf, uint32_t size) {
+	uint32_t result = 0;
+	for (int i = 0; i < size; i++) {
+		result += buf[i];
+	}
+	return result;
+}
+
+// Everything the old front panel sent for the W data, block_end gets the text offset
+// after each block's checksum line. Returns the text length.
+static uint32_t runtime_encode(char* out, uint32_t* block_end, uint32_t* num_blocks,
+		uint8_t* modulefw, uint32_t modulefwsize) {
+	uint32_t txlen = 0, offset = 0;
+	*num_blocks = 0;
+	while (offset < modulefwsize) {
+		uint32_t block = offset, rows = 0;
+		bool complete = false;
+		while (!complete) {
+			uint32_t len = modulefwsize - offset;
+			if (len > 45) len = 45;
+			txlen += uuencode(&out[txlen], &modulefw[offset], len);
+			offset += len;
+			rows++;
+			complete = rows == ISP_ROWS_PER_BLOCK || offset == modulefwsize;
+		}
+		uint32_t cksum = calc_checksum(&modulefw[block], offset - block);
+		txlen += num2ascii(&out[txlen], cksum);
+		out[txlen++] = '\r';
+		out[txlen++] = '\n';
+		block_end[(*num_blocks)++] = txlen;
+	}
+	return txlen;
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void fail(const char* what) {
+	printf("FAIL: %s\n", what);
+	exit(1);
+}
+
+// Plain uudecode of every row between the checksum lines, the checksums are checked too
+static uint32_t decode(uint8_t* blob, const char* text, const uint32_t* block_end, uint32_t num_blocks) {
+	uint32_t size = 0, pos = 0;
+	for (uint32_t b = 0; b < num_blocks; b++) {
+		uint32_t block = size;
+		while (pos < block_end[b]) {
+			const char* line = &text[pos];
+			const char* eol = strstr(line, "\r\n");
+			if (!eol || eol - text >= block_end[b]) fail("unterminated line");
+			pos = eol - text + 2;
+			if (pos == block_end[b]) { // Checksum line
+				if (strtoul(line, NULL, 10) != calc_checksum(&blob[block], size - block)) fail("block checksum");
+				break;
+			}
+			uint32_t len = (line[0] - 0x20) & 0x3f;
+			if (size + len > MAX_BLOB) fail("blob too large");
+			for (uint32_t i = 0; i < len; i += 3) {
+				const char* g = &line[1 + (i / 3) * 4];
+				uint32_t group = 0;
+				for (uint32_t j = 0; j < 4; j++) group = group << 6 | ((g[j] - 0x20) & 0x3f);
+				for (uint32_t j = 0; j < 3 && i + j < len; j++) blob[size++] = group >> (16 - 8 * j);
+			}
+		}
+	}
+	return size;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		printf("usage: %s ps2k-riser.isp\n", argv[0]);
+		return 2;
+	}
+	FILE* f = fopen(argv[1], "rb");
+	if (!f) fail("can't open the stream");
+	static uint8_t file[64 * 1024];
+	size_t file_len = fread(file, 1, sizeof(file), f);
+	fclose(f);
+
+	if (file_len < 20) fail("file too short");
+	uint32_t size = get_u32(&file[8]);
+	uint32_t num_blocks = get_u32(&file[16]);
+	uint32_t header = 20 + 4 * num_blocks;
+	if (num_blocks > 64 || file_len < header) fail("bad header");
+	uint32_t block_end[64];
+	for (uint32_t b = 0; b < num_blocks; b++) block_end[b] = get_u32(&file[20 + 4 * b]);
+	const char* text = (const char*)&file[header];
+	uint32_t text_len = file_len - header;
+	if (!num_blocks || block_end[num_blocks - 1] != text_len) fail("block table doesn't end at the end of the text");
+
+	static uint8_t blob[MAX_BLOB];
+	if (decode(blob, text, block_end, num_blocks) != size) fail("decoded size differs from the header");
+
+	static char ref[64 * 1024];
+	uint32_t ref_block_end[64], ref_blocks;
+	uint32_t ref_len = runtime_encode(ref, ref_block_end, &ref_blocks, blob, size);
+	if (ref_blocks != num_blocks || memcmp(ref_block_end, block_end, 4 * num_blocks)) fail("block boundaries differ");
+	if (ref_len != text_len || memcmp(ref, text, text_len)) fail("text differs from the runtime encoder");
+
+	printf("OK, %u byte blob, %u blocks, %u bytes of text identical to the runtime encoder\n",
+			size, num_blocks, text_len);
+	return 0;
+}
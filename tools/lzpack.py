@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+#
+# lzpack.py - Compress and ISP-encode the ps2k-riser RAM image for the front panel
+#
+# Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Run as a post-build step of ps2k-riser, after building the stub in tools/lzstub.s:
+#   tools/lzpack.py --stub lzstub.bin ps2k-riser.bin ps2k-riser.isp
+#
+# The blob loaded to the top of riser RAM is a 16 byte header (destination address, raw
+# size, entry point and image id, all little endian 32-bit), the compressed stream and the
+# decompressor stub. The stub expands the image to its final location and jumps to
+# the entry point.
+#
+# The blob is written to the output already encoded the way the ISP W command wants it
+# (uuencoded rows of 45 bytes, decimal checksum after every 20 rows), so the front panel
+# only has to copy it from flash to the UARTs. Output format, little endian 32-bit words:
+#   load address, stub address, blob size, image id, number of blocks n
+#   n offsets to the end of each block in the text
+#   text, every block ends with its checksum line
+# The output is decoded again on every build. tools/ispstreamcheck.c compares it byte for
+# byte with what the front panel's old runtime encoder sent for the same blob.
+#
+# Stream format, keep in sync with tools/lzstub.s:
+#   0x00-0x7f n          literal run, n+1 bytes follow
+#   0x80-0xff n lo hi    match, copy (n & 0x7f) + 3 bytes from offset lo | hi << 8 back
+#
+# The image is decompressed to the same RAM the compressed data is in, so every output
+# byte has to be written below the input still to be read. This is checked here, as is
+# that decompressing gives back the exact input image.
+#
+# The image id is a CRC32 of the image, patched into the image itself (the riser reports it
+# in object 0x4a) so the front panel can tell if a riser already runs this exact image.
+
+import argparse
+import binascii
+import struct
+import sys
+import zlib
+
+# LPC1315 RAM, the top 32 bytes and 256 bytes of stack below that are used by ISP
+RAM_TOP = 0x10002000 - 32 - 256
+
+ISP_ROW_SIZE = 45
+ISP_ROWS_PER_BLOCK = 20
+
+MIN_MATCH = 3
+MAX_MATCH = 0x7f + MIN_MATCH
+MAX_LITERALS = 0x80
+MAX_OFFSET = 0xffff
+HASH_CHAIN = 64
+
+# s_image_id in ps2k-riser.c, the magic is followed by the id which is 0 until patched
+IMAGE_ID_MAGIC = struct.pack("<II", 0x44493250, 0)
+
+
+def compress(data):
+    out = bytearray()
+    literals = bytearray()
+    # Input position where each output token ends, for the in-place check
+    events = []
+    chains = {}
+
+    def flush_literals(pos):
+        while literals:
+            run = literals[:MAX_LITERALS]
+            del literals[:MAX_LITERALS]
+            out.append(len(run) - 1)
+            out.extend(run)
+            events.append((len(out), pos - len(literals)))
+
+    def insert(pos):
+        if pos + MIN_MATCH <= len(data):
+            chains.setdefault(data[pos:pos + MIN_MATCH], []).append(pos)
+
+    pos = 0
+    while pos < len(data):
+        best_len, best_off = 0, 0
+        for cand in reversed(chains.get(data[pos:pos + MIN_MATCH], [])[-HASH_CHAIN:]):
+            off = pos - cand
+            if off > MAX_OFFSET:
+                break
+            length = 0
+            while (length < MAX_MATCH and pos + length < len(data) and
+                   data[cand + length] == data[pos + length]):
+                length += 1
+            if length > best_len:
+                best_len, best_off = length, off
+                if length == MAX_MATCH:
+                    break
+
+        if best_len >= MIN_MATCH:
+            flush_literals(pos)
+            out.extend((0x80 | (best_len - MIN_MATCH), best_off & 0xff, best_off >> 8))
+            for i in range(best_len):
+                insert(pos + i)
+            pos += best_len
+            events.append((len(out), pos))
+        else:
+            literals.append(data[pos])
+            insert(pos)
+            pos += 1
+            if len(literals) == MAX_LITERALS:
+                flush_literals(pos)
+    flush_literals(pos)
+    return bytes(out), events
+
+
+# Reference implementation of the stub
+def decompress(stream, size):
+    out = bytearray()
+    i = 0
+    while len(out) < size:
+        token = stream[i]
+        i += 1
+        if token < 0x80:
+            out.extend(stream[i:i + token + 1])
+            i += token + 1
+        else:
+            offset = stream[i] | stream[i + 1] << 8
+            i += 2
+            for _ in range((token & 0x7f) + MIN_MATCH):
+                out.append(out[-offset])
+    return bytes(out)
+
+
+def patch_image_id(image):
+    pos = image.find(IMAGE_ID_MAGIC)
+    if pos < 0 or image.find(IMAGE_ID_MAGIC, pos + 1) >= 0:
+        sys.exit("lzpack: image id placeholder not found exactly once")
+    image_id = zlib.crc32(image) or 1  # 0 means unpatched
+    struct.pack_into("<I", image, pos + 4, image_id)
+    return image_id
+
+
+def uuencode_row(data):
+    # Same as the LPC ISP expects, zero 6-bit groups are sent as '`' rather than ' '
+    line = bytearray([0x20 + len(data)])
+    padded = data + bytes(-len(data) % 3)
+    for i in range(0, len(padded), 3):
+        group = padded[i] << 16 | padded[i + 1] << 8 | padded[i + 2]
+        for shift in (18, 12, 6, 0):
+            c = (group >> shift) & 0x3f
+            line.append(0x20 + c if c else 0x60)
+    return bytes(line) + b"\r\n"
+
+
+def isp_encode(blob):
+    text = bytearray()
+    block_ends = []
+    block_size = ISP_ROW_SIZE * ISP_ROWS_PER_BLOCK
+    for block in range(0, len(blob), block_size):
+        data = blob[block:block + block_size]
+        for row in range(0, len(data), ISP_ROW_SIZE):
+            text += uuencode_row(data[row:row + ISP_ROW_SIZE])
+        text += b"%d\r\n" % sum(data)
+        block_ends.append(len(text))
+    return bytes(text), block_ends
+
+
+def isp_decode(text, block_ends):
+    blob = bytearray()
+    start = 0
+    for end in block_ends:
+        lines = text[start:end].split(b"\r\n")[:-1]
+        data = b"".join(binascii.a2b_uu(line) for line in lines[:-1])
+        if int(lines[-1]) != sum(data):
+            sys.exit("lzpack: ISP block checksum mismatch")
+        blob += data
+        start = end
+    return bytes(blob)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress and ISP-encode the riser RAM image")
+    parser.add_argument("input", help="ps2k-riser.bin")
+    parser.add_argument("output", help="ISP stream to include in the front panel firmware")
+    parser.add_argument("--stub", required=True, help="tools/lzstub.s assembled to a flat binary")
+    args = parser.parse_args()
+
+    with open(args.stub, "rb") as f:
+        stub = f.read()
+    # Ends with the stub_offset word, 0 until patched below
+    if len(stub) < 8 or len(stub) % 4 or struct.unpack_from("<I", stub, len(stub) - 4)[0]:
+        sys.exit("lzpack: %s doesn't look like the assembled stub" % args.stub)
+
+    with open(args.input, "rb") as f:
+        image = bytearray(f.read())
+    image_id = patch_image_id(image)
+    image = bytes(image)
+
+    # Same assumption as the front panel always made, the image starts at the reset
+    # vector rounded down to 256 bytes
+    entry = struct.unpack_from("<I", image, 4)[0]
+    dest = (entry & ~1) & ~0xff
+
+    stream, events = compress(image)
+    if decompress(stream, len(image)) != image:
+        sys.exit("lzpack: decompressed image doesn't match")
+
+    # Blob is header, stream, stub (word aligned, as is the blob size for W)
+    blob = bytearray(struct.pack("<IIII", dest, len(image), entry, image_id))
+    blob += stream
+    blob += bytes(-len(blob) % 4)
+    stub_start = len(blob)
+    blob += stub[:-4] + struct.pack("<I", stub_start + 4)  # stub_offset
+    load = RAM_TOP - len(blob)
+
+    stream_start = load + 16
+    for in_end, out_end in events:
+        # All input of a token has been read before its output is written
+        if dest + out_end > stream_start + in_end:
+            sys.exit("lzpack: image too large to decompress in place (0x%x bytes)" % len(image))
+    if dest + len(image) > stream_start + len(stream):
+        sys.exit("lzpack: image too large to decompress in place (0x%x bytes)" % len(image))
+
+    text, block_ends = isp_encode(bytes(blob))
+    if isp_decode(text, block_ends) != blob:
+        sys.exit("lzpack: ISP stream doesn't decode to the blob")
+
+    with open(args.output, "wb") as f:
+        f.write(struct.pack("<IIIII", load, load + stub_start, len(blob), image_id, len(block_ends)))
+        f.write(struct.pack("<%dI" % len(block_ends), *block_ends))
+        f.write(text)
+
+    print("lzpack: %d -> %d bytes (%d%%), %d ISP blocks, image id %08x" % (len(image), len(blob),
+          (100 * len(blob)) // len(image), len(block_ends), image_id))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,71 @@
+@ lzstub.s - Decompressor stub loaded with the ps2k-riser image, see tools/lzpack.py
+@
+@ Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+@
+@ This program is free software: you can redistribute it and/or modify
+@ it under the terms of the GNU General Public License as published by
+@ the Free Software Foundation, either version 3 of the License, or
+@ (at your option) any later version.
+@ This program is distributed in the hope that it will be useful,
+@ but WITHOUT ANY WARRANTY; without even the implied warranty of
+@ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+@ GNU General Public License for more details.
+@ You should have received a copy of the GNU General Public License
+@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+@
+@ Built by the ps2k-riser post-build step with the riser toolchain and handed to lzpack.py
+@ as a flat binary:
+@   arm-none-eabi-as -mcpu=cortex-m3 -mthumb -o lzstub.o tools/lzstub.s
+@   arm-none-eabi-objcopy -O binary lzstub.o lzstub.bin
+@
+@ Position independent, it runs from wherever the front panel put the blob. The blob
+@ header is found through stub_offset, which lzpack.py patches when the blob is put
+@ together. Stream format as in lzpack.py:
+@   0x00-0x7f n          literal run, n+1 bytes follow
+@   0x80-0xff n lo hi    match, copy (n & 0x7f) + 3 bytes from offset lo | hi << 8 back
+
+	.syntax unified
+	.cpu cortex-m3
+	.thumb
+	.text
+
+	.global lzstub
+	.thumb_func
+lzstub:
+	mov	r0, pc			@ lzstub + 4
+	ldr	r1, stub_offset
+	subs	r0, r0, r1		@ header at start of blob
+	ldmia	r0!, {r1-r4}		@ dest, size, entry, image id
+	adds	r2, r1, r2		@ end of output
+lz_token:
+	cmp	r1, r2
+	bhs	lz_done
+	ldrb	r4, [r0], #1
+	cmp	r4, #0x80
+	bhs	lz_match
+	adds	r4, r4, #1		@ literal run
+lz_literal:
+	ldrb	r5, [r0], #1
+	strb	r5, [r1], #1
+	subs	r4, r4, #1
+	bne	lz_literal
+	b	lz_token
+lz_match:
+	and	r4, r4, #0x7f
+	adds	r4, r4, #3
+	ldrb	r5, [r0], #1
+	ldrb	r6, [r0], #1
+	orr	r5, r5, r6, lsl #8
+	subs	r5, r1, r5		@ offset bytes back in the output
+lz_copy:
+	ldrb	r6, [r5], #1
+	strb	r6, [r1], #1
+	subs	r4, r4, #1
+	bne	lz_copy
+	b	lz_token
+lz_done:
+	bx	r3			@ entry has the thumb bit set
+
+	.balign	4
+stub_offset:
+	.word	0			@ lzstub + 4 - start of blob, patched by lzpack.py
@@ -0,0 +1,85 @@
+/*
+ * psconvcheck.c - Host check of the front panel display <-> riser unit conversion
+ *
+ * Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Builds the firmware's psconv.c on the host and checks it exhaustively:
+//   cc -O2 -Wall -Ips2k-front/src -o psconvcheck tools/psconvcheck.c ps2k-front/src/psconv.c -lm
+//   ./psconvcheck
+//
+// For the nominal voltages and currents of the supported models the FLASH_CAL float has
+// to decode to the same number of decimals and max_setpoint as plain floating point gives,
+// and every display value has to survive display -> percent -> display. Both directions
+// have to be monotonic, the latter over the whole 16-bit readback range. The same is then
+// checked for every possible max_setpoint, in case a unit has an unusual calibration.
+// Exits with 1 on the first failure.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "psconv.h"
+
+// PS 2042-06B/10B/20B, 2084-03B/05B and the triple PS 2342/2384 versions
+static const float s_nominals[] = {42.0f, 84.0f, 3.0f, 5.0f, 6.0f, 10.0f, 20.0f};
+#define NUM_NOMINALS (sizeof(s_nominals) / sizeof(s_nominals[0]))
+
+static void fail(const char* what, uint32_t max_setpoint, uint32_t val) {
+	printf("FAIL: %s (max_setpoint %u, value %u)\n", what, max_setpoint, val);
+	exit(1);
+}
+
+static void check_decode(float nominal) {
+	uint32_t num_decimals = psconv_num_decimals(&nominal);
+	uint32_t max_setpoint = psconv_nominal_round(&nominal, psconv_scale_factor(num_decimals));
+
+	uint32_t ref_decimals = nominal < 10 ? 3 : nominal < 100 ? 2 : nominal < 1000 ? 1 : 0;
+	uint32_t ref_max = (uint32_t)lround(nominal * pow(10, ref_decimals));
+	if (num_decimals != ref_decimals) fail("decimals differ from float decoding", max_setpoint, num_decimals);
+	if (max_setpoint != ref_max) fail("max_setpoint differs from float decoding", max_setpoint, ref_max);
+	if (max_setpoint > 9999) fail("nominal doesn't fit four digits", max_setpoint, max_setpoint);
+	printf("nominal %g: %u decimals, max_setpoint %u\n", nominal, num_decimals, max_setpoint);
+}
+
+static void check_conversion(uint32_t max_setpoint) {
+	uint32_t last = 0;
+	for (uint32_t disp = 0; disp <= max_setpoint; disp++) {
+		uint32_t percent = psconv_to_percent(disp, max_setpoint);
+		if (disp && percent <= last) fail("display -> percent not strictly increasing", max_setpoint, disp);
+		if (percent > PS_FULL_SCALE) fail("percent above full scale", max_setpoint, disp);
+		if (psconv_to_display(percent, max_setpoint) != disp) fail("display -> percent -> display", max_setpoint, disp);
+		last = percent;
+	}
+	if (last != PS_FULL_SCALE) fail("nominal isn't full scale", max_setpoint, last);
+
+	last = 0;
+	for (uint32_t percent = 0; percent <= 0xffff; percent++) {
+		uint32_t disp = psconv_to_display(percent, max_setpoint);
+		if (disp < last) fail("percent -> display not monotonic", max_setpoint, percent);
+		last = disp;
+	}
+}
+
+int main(void) {
+	for (uint32_t i = 0; i < NUM_NOMINALS; i++) {
+		check_decode(s_nominals[i]);
+		float nominal = s_nominals[i];
+		check_conversion(psconv_nominal_round(&nominal, psconv_scale_factor(psconv_num_decimals(&nominal))));
+	}
+	for (uint32_t max_setpoint = 1; max_setpoint <= 9999; max_setpoint++) {
+		check_conversion(max_setpoint);
+	}
+	printf("OK, all max_setpoint values 1-9999 checked\n");
+	return 0;
+}
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+#
+# swotrace.py - Decode a captured ps2k-riser SWO stream into a readable timeline
+#
+# Copyright (C) 2021 Werner Johansson, wj@unifiedengineering.se
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# The riser runs SWO in NRZ (UART) mode at 115200 8N1 with the TPIU formatter bypassed,
+# so a plain USB-UART on the SWO pin can capture the raw ITM packet stream, e.g.:
+#   stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 > swo.bin
+#   tools/swotrace.py swo.bin
+# Reading from a tty directly works too, events are printed as they come in:
+#   tools/swotrace.py /dev/ttyUSB0
+
+import argparse
+import os
+import sys
+
+CPU_HZ = 72000000
+
+# Keep in sync with trace_id_t in ps2k-riser/src/trace.h
+TRACE_PORT_TIMESTAMP = 1
+TRACE_PORT_EVENT = 2
+EVENTS = {
+    0: ("DROPPED", lambda p: "%d events lost" % p),
+    1: ("RX_FRAME", lambda p: "type 0x%02x len %d" % (p & 0xf0, p & 0xf)),
+    2: ("RX_TIMEOUT", lambda p: "%d bytes discarded" % p),
+    3: ("SETPOINT_REJECTED", lambda p: "power %d" % p),
+    4: ("ADC_RESULT", lambda p: "ch %d value %d" % (p >> 16, p & 0xffff)),
+    5: ("OVERTEMP", lambda p: "trip" if p else "release"),
+    6: ("LINK_TIMEOUT", lambda p: "%dms since last frame" % p),
+}
+
+
+def read_chunks(f):
+    # os.read returns what is there rather than waiting for a full buffer (or EOF on a tty)
+    while True:
+        chunk = os.read(f.fileno(), 4096)
+        if not chunk:
+            return
+        yield chunk
+
+
+def itm_packets(chunks):
+    # Yields (port, value, size) for software source packets, skips sync/overflow/other packets.
+    # A packet split between chunks is kept until the rest has arrived.
+    data = b""
+    for chunk in chunks:
+        data += chunk
+        i = 0
+        n = len(data)
+        while i < n:
+            start = i
+            hdr = data[i]
+            i += 1
+            if hdr == 0x00:
+                # Sync packet (or part of one), zeros followed by 0x80
+                while i < n and data[i] == 0x00:
+                    i += 1
+                if i == n:
+                    i -= 1  # Keep a zero, the 0x80 may be in the next chunk
+                    break
+                if data[i] == 0x80:
+                    i += 1
+                continue
+            if hdr == 0x70:
+                yield (None, "overflow", 0)
+                continue
+            size = (1, 2, 4)[(hdr & 0x3) - 1] if hdr & 0x3 else 0
+            if size == 0:
+                # Protocol packet (timestamps etc), not enabled on the riser, skip continuation bytes
+                while hdr & 0x80 and i < n:
+                    hdr = data[i]
+                    i += 1
+                if hdr & 0x80:
+                    i = start
+                    break
+                continue
+            if i + size > n:
+                i = start
+                break
+            value = int.from_bytes(data[i:i + size], "little")
+            i += size
+            if hdr & 0x4:
+                continue # Hardware source (DWT) packet, not used
+            yield (hdr >> 3, value, size)
+        data = data[i:]
+
+
+def decode(chunks, out, show_text):
+    ts = None
+    last = None
+    wraps = 0
+    prev_raw = None
+    text = ""
+    for port, value, size in itm_packets(chunks):
+        if port is None:
+            out.write("%14s  ITM overflow\n" % "")
+        elif port == 0:
+            if show_text:
+                ch = chr(value & 0xff)
+                if ch == "\n":
+                    out.write("%14s  text: %s\n" % ("", text.rstrip("\r")))
+                    out.flush()
+                    text = ""
+                else:
+                    text += ch
+        elif port == TRACE_PORT_TIMESTAMP:
+            # Unwrap the 32-bit cycle counter (wraps every ~60s at 72MHz)
+            if prev_raw is not None and value < prev_raw:
+                wraps += 1
+            prev_raw = value
+            ts = (wraps << 32) + value
+        elif port == TRACE_PORT_EVENT:
+            if ts is None:
+                continue # Capture started between timestamp and event
+            ev = value >> 24
+            payload = value & 0xffffff
+            name, fmt = EVENTS.get(ev, ("EVENT_%d" % ev, lambda p: "0x%06x" % p))
+            us = ts * 1e6 / CPU_HZ
+            delta = "" if last is None else "+%.1f" % ((ts - last) * 1e6 / CPU_HZ)
+            out.write("%12.1fus %10s  %-18s %s\n" % (us, delta, name, fmt(payload)))
+            out.flush()
+            last = ts
+            ts = None
+    if show_text and text:
+        out.write("%14s  text: %s\n" % ("", text.rstrip("\r")))
+
+
+def main():
+    global CPU_HZ
+    parser = argparse.ArgumentParser(description="Decode ps2k-riser SWO trace capture")
+    parser.add_argument("capture", help="raw SWO capture file (or tty device)")
+    parser.add_argument("--no-text", action="store_true", help="hide port 0 text output")
+    parser.add_argument("--cpu-hz", type=int, default=CPU_HZ, help="riser core clock (default %(default)d)")
+    args = parser.parse_args()
+
+    CPU_HZ = args.cpu_hz
+    with open(args.capture, "rb", buffering=0) as f:
+        decode(read_chunks(f), sys.stdout, not args.no_text)
+
+
+if __name__ == "__main__":
+    main()